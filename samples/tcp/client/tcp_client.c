@@ -17,7 +17,7 @@
 static struct task_struct *client_thread;
 
 static int tcp_client_fn(void *data) {
-    struct socket *sock;
+    ksocket_t sock;
     struct sockaddr_in server_addr;
     char *ip = (char *)data ? (char *)data : DEFAULT_IP;
     int port = DEFAULT_PORT;
@@ -37,24 +37,17 @@ static int tcp_client_fn(void *data) {
     server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = inet_addr(ip);
 
-    // Connect to server
-    ret = kconnect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    // Connect and send; with TCP Fast Open the message rides in the SYN
+    ret = kconnect_send(sock, (struct sockaddr *)&server_addr, sizeof(server_addr),
+                        message, strlen(message), 0);
     if (ret < 0) {
-        printk(KERN_ERR "[tcp_client] Failed to connect to %s:%d (err=%d)\n", ip, port, ret);
+        printk(KERN_ERR "[tcp_client] Failed to connect/send to %s:%d (err=%d)\n", ip, port, ret);
         kclose(sock);
         return ret;
     }
 
     printk(KERN_INFO "[tcp_client] Connected to %s:%d\n", ip, port);
 
-    // Send message
-    ret = ksend(sock, (void *)message, strlen(message), 0);
-    if (ret < 0) {
-        printk(KERN_ERR "[tcp_client] Failed to send message (err=%d)\n", ret);
-        kclose(sock);
-        return ret;
-    }
-
     printk(KERN_INFO "[tcp_client] Sent: %s\n", message);
 
     kclose(sock);
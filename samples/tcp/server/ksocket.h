@@ -7,11 +7,11 @@
  * 
  * This code is licenced under the GPL
  * Feel free to contact me if any questions
- * 
+ *
  * @2017
  * Hardik Bagdi (hbagdi1@binghamton.edu)
  * Changes for Compatibility with Linux 4.9 to use iov_iter
-  *
+ *
  * @2025
  * Mephistolist (cloneozone@gmail.com)
  * Changes for kernels 5.11 through at least 6.16. 
@@ -19,15 +19,32 @@
 #ifndef _ksocket_h_
 #define _ksocket_h_
 
-struct socket;
+struct ksocket;
 struct sockaddr;
+struct sockaddr_storage;
 struct in_addr;
-typedef struct socket * ksocket_t;
+struct tcp_info;
+struct sock_fprog_kern;
+struct bpf_prog;
+typedef struct ksocket * ksocket_t;
+
+/*
+ * A ksocket_t is a refcounted handle. Calls on it from several kthreads at
+ * once are safe (e.g. one thread in krecv(), another in ksend()). kclose()
+ * wakes blocked callers and drops the owner's reference; the socket is
+ * released when the last in-flight call returns. A call that starts
+ * after that reads freed memory, so any thread that may still use a
+ * handle it does not own must hold its own khold() reference, and drop
+ * it with kput(). Calls made under such a reference fail with -EBADF
+ * once kclose() has started.
+ */
 
 /* BSD socket APIs prototype declaration */
 extern ksocket_t ksocket(int domain, int type, int protocol);
 extern int kshutdown(ksocket_t socket, int how);
 extern int kclose(ksocket_t socket);
+extern ksocket_t khold(ksocket_t socket); /* NULL once kclose() has started */
+extern void kput(ksocket_t socket);
 
 extern int kbind(ksocket_t socket, struct sockaddr *address, int address_len);
 extern int klisten(ksocket_t socket, int backlog);
@@ -42,9 +59,371 @@ extern ssize_t ksendto(ksocket_t socket, void *message, size_t length, int flags
 extern int kgetsockname(ksocket_t socket, struct sockaddr *address, int *address_len);
 extern int kgetpeername(ksocket_t socket, struct sockaddr *address, int *address_len);
 extern int ksetsockopt(ksocket_t socket, int level, int optname, void *optval, int optlen);
+/*
+ * kgetsockopt() takes kernel buffers, so it answers a fixed set of
+ * options itself: TCP_INFO, TCP_CONGESTION, TCP_NODELAY, TCP_MAXSEG and
+ * the common integer SOL_SOCKET ones. Anything else is -ENOPROTOOPT.
+ */
 extern int kgetsockopt(ksocket_t socket, int level, int optname, void *optval, int *optlen);
 
-extern unsigned int inet_addr(char* ip);
+extern unsigned int inet_addr(char* ip); /* INADDR_NONE if ip is not a dotted quad */
 extern char *inet_ntoa(struct in_addr *in); /* DO NOT forget to kfree the return pointer */
 
+/*
+ * Allocation-free address helpers for IPv4 and IPv6. kinet_pton() fills
+ * a struct in_addr/in6_addr, -EINVAL on bad input. kinet_ntop() and
+ * ksockaddr_format() write into buf and return the length, -ENOSPC if
+ * it does not fit; KSOCKADDR_STRLEN always does. ksockaddr_parse()
+ * takes "a.b.c.d", "a.b.c.d:port", "v6addr" or "[v6addr]:port" (v6
+ * with an optional %scope). ksockaddr_hash() and ksockaddr_equal() key
+ * connection tables by address and port.
+ */
+#define KSOCKADDR_STRLEN	64
+
+extern int kinet_pton(int family, const char *src, void *dst);
+extern int kinet_ntop(int family, const void *src, char *dst, size_t size);
+extern int ksockaddr_parse(const char *str, struct sockaddr_storage *addr, int *address_len);
+extern int ksockaddr_format(const struct sockaddr *address, char *buf, size_t size);
+extern unsigned int ksockaddr_hash(const struct sockaddr *address, unsigned int seed);
+extern bool ksockaddr_equal(const struct sockaddr *a, const struct sockaddr *b);
+
+/* Module-wide counters, also readable from /proc/net/ksocket */
+struct ksocket_stats {
+	unsigned long long busy_poll_hits;	/* data arrived while spinning */
+	unsigned long long busy_poll_misses;	/* budget ran out, receive slept */
+	unsigned long long affine_accepts;	/* connections handed to a kserver worker */
+	unsigned long long affine_fallbacks;	/* no worker on the flow's cpu or node */
+	unsigned long long tfo_connect_hits;	/* kconnect_send() data acked in the SYN */
+	unsigned long long tfo_connect_misses;	/* data went after the handshake */
+	unsigned long long tfo_accepts;		/* kaccept() of a fast open connection */
+	unsigned long long accept_data_ready;	/* kaccept_data() returned data */
+	unsigned long long accept_data_empty;	/* kaccept_data() found nothing queued */
+	unsigned long long idle_events;		/* kidle callbacks fired */
+	unsigned long long idle_closes;		/* sockets shut down by a kidle manager */
+	unsigned long long local_connects;	/* connections short-circuited in kernel */
+	unsigned long long ring_records;	/* records received into the mmap ring */
+	unsigned long long ring_full;		/* ring receive refused, reader behind */
+	unsigned long long fanout_datagrams;	/* datagrams sent by ksendto_fanout */
+	unsigned long long tcp_samples;		/* tcp_info snapshots taken by samplers */
+	unsigned long long tcp_sample_retrans;	/* retransmits seen between samples */
+	unsigned long long tcp_sample_bytes_acked; /* bytes acked between samples */
+	unsigned long long writable_events;	/* writable callbacks run */
+	unsigned long long throttle_waits;	/* sends delayed by a rate limit */
+	unsigned long long throttle_ns;		/* time spent in those delays */
+	unsigned long long reuseport_drained;	/* queued connections handed over on shrink */
+};
+
+extern void kget_stats(struct ksocket_stats *stats);
+
+/*
+ * Low-latency receive: sets SO_BUSY_POLL (and SO_PREFER_BUSY_POLL when
+ * prefer is non-zero). While usecs is non-zero, blocking krecv() and
+ * krecvfrom() spin up to usecs on the receive queue before sleeping.
+ * usecs == 0 turns it off.
+ */
+extern int kset_busy_poll(ksocket_t socket, unsigned int usecs, int prefer);
+
+/*
+ * Locality: the cpu a socket's packets were last processed on
+ * (SO_INCOMING_CPU) and its NUMA node, -1 / NUMA_NO_NODE if unknown.
+ * kalloc_local() kmallocs on that node.
+ */
+extern int kget_incoming_cpu(ksocket_t socket);
+extern int kget_numa_node(ksocket_t socket);
+extern void *kalloc_local(ksocket_t socket, size_t size, gfp_t flags);
+
+/*
+ * Accept loop with one pinned worker per cpu in cpus (NULL: all online).
+ * Each connection is handed to the worker on its incoming cpu, or one on
+ * the same node, together with a buf_len buffer from that node. The
+ * connection is closed when the handler returns. kserver_stop() shuts
+ * down connections still in a handler and leaves the listener as it
+ * was, still the caller's to accept on or kclose().
+ */
+struct kserver;
+struct cpumask;
+typedef void (*kserver_handler_t)(void *ctx, ksocket_t client, void *buffer, size_t length);
+
+extern struct kserver *kserver_start(ksocket_t listener, const struct cpumask *cpus, kserver_handler_t handler, void *ctx, size_t buf_len);
+extern void kserver_stop(struct kserver *srv);
+
+/*
+ * TCP Fast Open. kconnect_send() connects and sends the first payload,
+ * carried in the SYN when a cookie for the server is cached, otherwise
+ * a plain kconnect() + ksend(). klisten_fastopen() sets TCP_FASTOPEN
+ * with a pending-request queue of qlen before listening. Both ends are
+ * gated by the net.ipv4.tcp_fastopen sysctl (1 client, 2 server).
+ */
+extern int klisten_fastopen(ksocket_t socket, int backlog, int qlen);
+extern ssize_t kconnect_send(ksocket_t socket, struct sockaddr *address, int address_len, const void *buffer, size_t length, int flags);
+
+/*
+ * Deferred accept. klisten_defer() sets TCP_DEFER_ACCEPT so a connection
+ * reaches the accept queue only once data arrives (or after about secs,
+ * when the kernel gives up waiting). kaccept_data() accepts and reads
+ * whatever is already queued without blocking; *received is the byte
+ * count, 0 on EOF or -EAGAIN when nothing was there.
+ */
+extern int klisten_defer(ksocket_t socket, int backlog, int secs);
+extern ksocket_t kaccept_data(ksocket_t socket, struct sockaddr *address, int *address_len, void *buffer, size_t length, ssize_t *received);
+
+/*
+ * SO_REUSEPORT listener groups. kreuse_create() binds n sockets to one
+ * address (a port of 0 is picked once for all) and listens on them if
+ * they are SOCK_STREAM. kreuse_get() returns the member at index with a
+ * reference for the caller to accept on and kput().
+ *
+ * A steering program picks the member for each new connection by
+ * returning its index; out of range falls back to the hash.
+ * kreuse_attach_cbpf() builds a classic program from filter code in
+ * kernel memory. kreuse_attach_ebpf() takes a SK_REUSEPORT or
+ * SOCKET_FILTER program the caller holds a reference on (bpf_prog_get()
+ * and the like), which the group keeps on success. kreuse_steer_cpu()
+ * attaches a canned one returning the cpu the SYN is processed on, for
+ * a member per cpu with its acceptor pinned there. Each replaces the
+ * current program, kreuse_detach() restores plain hashing.
+ *
+ * kreuse_grow() adds listeners at the end and kreuse_shrink() removes
+ * the newest ones, so existing indexes stay valid; both return the new
+ * size or a negative errno, and a failed grow leaves the group as it
+ * was. A removed listener first stops taking new connections, then the
+ * ones on its queue are accepted and passed to drain (closed if NULL).
+ * Handshakes still in flight when it closes are reset unless
+ * net.ipv4.tcp_migrate_req is set, which moves them to the remaining
+ * members.
+ */
+struct kreuse;
+typedef void (*kreuse_drain_fn_t)(void *ctx, ksocket_t client);
+
+extern struct kreuse *kreuse_create(int type, int protocol, struct sockaddr *address, int address_len, int backlog, unsigned int n);
+extern void kreuse_destroy(struct kreuse *g);
+extern int kreuse_grow(struct kreuse *g, unsigned int n);
+extern int kreuse_shrink(struct kreuse *g, unsigned int n, kreuse_drain_fn_t drain, void *ctx);
+extern unsigned int kreuse_count(struct kreuse *g);
+extern ksocket_t kreuse_get(struct kreuse *g, unsigned int index);
+extern int kreuse_attach_cbpf(struct kreuse *g, struct sock_fprog_kern *fprog);
+extern int kreuse_attach_ebpf(struct kreuse *g, struct bpf_prog *prog);
+extern int kreuse_steer_cpu(struct kreuse *g);
+extern int kreuse_detach(struct kreuse *g);
+
+/*
+ * UDP multicast. kmcast_join()/kmcast_leave() take an IPv4 or IPv6 group
+ * matching the socket's family, an optional source for source-specific
+ * membership (NULL for any source) and an interface index (0 lets the
+ * route decide). kmcast_set() picks the sending interface, TTL/hop limit
+ * and loopback; pass -1 to leave any of them unchanged.
+ *
+ * ksendto_fanout() sends one datagram to each of count destinations and
+ * returns how many were sent, stopping at the first error (returned if
+ * none went out). Larger payloads are copied once and shared by every
+ * datagram on kernels that can splice pages into UDP (6.5+).
+ */
+extern int kmcast_join(ksocket_t socket, const struct sockaddr *group, const struct sockaddr *source, int ifindex);
+extern int kmcast_leave(ksocket_t socket, const struct sockaddr *group, const struct sockaddr *source, int ifindex);
+extern int kmcast_set(ksocket_t socket, int ifindex, int hops, int loop);
+extern ssize_t ksendto_fanout(ksocket_t socket, const void *message, size_t length, int flags, const struct sockaddr_storage *dests, unsigned int count);
+
+/*
+ * Idle, keepalive and deadline tracking for many sockets on one timer
+ * wheel ticking every tick_ms. Per socket: idle_ms without activity,
+ * keepalive_ms without activity (repeats while idle, e.g. to send an
+ * application ping) and deadline_ms after registration, 0 for off.
+ * TCP activity is taken from the stack's own send/receive timestamps;
+ * other sockets call kidle_touch().
+ *
+ * The callback runs from a workqueue and may sleep but must not call
+ * back into the manager. Returning 0 shuts the socket down and stops
+ * tracking it; the owner still kclose()s the socket and kidle_del()s
+ * the entry, which stays valid (kidle_touch() included) until then.
+ * Non-zero keeps it: the idle and keepalive timers restart, a deadline
+ * fires only once. KIDLE_DEAD reports a socket error or a peer that
+ * has gone away. kidle_destroy() frees any entries left.
+ */
+#define KIDLE_IDLE	1
+#define KIDLE_KEEPALIVE	2
+#define KIDLE_DEADLINE	3
+#define KIDLE_DEAD	4
+
+struct kidle;
+struct kidle_entry;
+typedef int (*kidle_fn_t)(ksocket_t socket, int event, void *priv);
+
+extern struct kidle *kidle_create(unsigned int tick_ms);
+extern void kidle_destroy(struct kidle *mgr);
+extern struct kidle_entry *kidle_add(struct kidle *mgr, ksocket_t socket, unsigned int idle_ms, unsigned int keepalive_ms, unsigned int deadline_ms, kidle_fn_t fn, void *priv);
+extern void kidle_del(struct kidle *mgr, struct kidle_entry *e);
+extern void kidle_touch(struct kidle_entry *e);
+
+/* SO_KEEPALIVE plus TCP_KEEPIDLE/INTVL/CNT in seconds, idle <= 0 disables */
+extern int kset_keepalive(ksocket_t socket, int idle, int interval, int count);
+
+/*
+ * Same-host transport, opt-in on both ends. After klocal_listen() on a
+ * listening TCP ksocket, klocal_connect() by service name, or with name
+ * NULL to a loopback address and that port, is served by an in-kernel
+ * queue of page references instead of TCP/IP; kaccept() returns those
+ * connections alongside normal ones and reports the loopback address as
+ * the peer. At most the listen backlog waits unaccepted (-ECONNREFUSED).
+ * When there is no such local service, klocal_connect() falls back to
+ * kconnect() to fallback. kconnect()/kconnect_send() always use TCP.
+ *
+ * ksend/krecv/ksendto/krecvfrom, kshutdown, krpc and kidle work on such
+ * connections. Receives honour MSG_DONTWAIT, MSG_PEEK and MSG_WAITALL
+ * and fail with -EOPNOTSUPP on any other flag. TCP and TLS options,
+ * kget_tcp_info(), kset_writable_cb() and the like fail with
+ * -EOPNOTSUPP. kgetsockname()/kgetpeername() fail with -ENOTCONN, as
+ * the socket underneath is an unconnected dummy; kaccept() still
+ * reports the peer.
+ */
+extern int klocal_listen(ksocket_t socket, const char *name);
+extern int klocal_connect(ksocket_t socket, const char *name, struct sockaddr *fallback, int fallback_len);
+
+/*
+ * Receive straight into a per-cpu ring that userspace maps from
+ * /dev/ksocket_ring (module parameter ring_pages sizes it). The mapping
+ * holds one ring per possible cpu, hdr->stride bytes apart: a page with
+ * struct kring_header, then hdr->size bytes of data. producer/consumer
+ * are free-running byte offsets; records start 8-byte aligned with a
+ * struct kring_rec, then (krecvfrom_ring() only) a sockaddr_storage
+ * slot whose first addr_len bytes hold the source, then len bytes of
+ * payload. KRING_REC_PAD records fill the end of the data area and are
+ * skipped. The reader advances consumer past what it has consumed and
+ * poll()s the device.
+ *
+ * krecv_ring()/krecvfrom_ring() return bytes received or -ENOBUFS when
+ * the ring is full (the data then stays queued on the socket). A
+ * datagram is only taken whole, up to length. ring_pages is capped at
+ * 1GB of ring per cpu. With MSG_MORE the record is not made visible
+ * until a later receive without it, or kring_flush().
+ */
+#define KRING_REC_DATA	0
+#define KRING_REC_PAD	1
+
+struct kring_header {
+	__u32 producer;		/* kernel writes */
+	__u32 pad0[15];
+	__u32 consumer;		/* reader writes */
+	__u32 pad1[15];
+	__u32 size;
+	__u32 nr_rings;
+	__u32 stride;
+};
+
+struct kring_rec {
+	__u32 len;
+	__u16 addr_len;
+	__u16 type;
+};
+
+extern ssize_t krecv_ring(ksocket_t socket, size_t length, int flags);
+extern ssize_t krecvfrom_ring(ksocket_t socket, size_t length, int flags);
+extern void kring_flush(void);
+
+/*
+ * TCP state. kget_tcp_info() fills a struct tcp_info snapshot (rtt,
+ * cwnd, retransmits, pacing and delivery rate...). kset_congestion()
+ * selects a congestion control module by name ("cubic", "bbr", loaded
+ * on demand); kget_congestion() reads the current one.
+ *
+ * ktcp_sample_start() snapshots a connection every interval_ms from a
+ * workqueue, holding a reference on it until ktcp_sample_stop(). The
+ * latest snapshot is read with ktcp_sample_last() (-EAGAIN before the
+ * first) and listed per connection in /proc/net/ksocket; retransmits
+ * and acked bytes between samples add to the tcp_sample_* counters.
+ */
+struct ktcp_sampler;
+
+extern int kget_tcp_info(ksocket_t socket, struct tcp_info *info);
+extern int kset_congestion(ksocket_t socket, const char *name);
+extern int kget_congestion(ksocket_t socket, char *name, int length);
+extern struct ktcp_sampler *ktcp_sample_start(ksocket_t socket, unsigned int interval_ms);
+extern int ktcp_sample_last(struct ktcp_sampler *s, struct tcp_info *info);
+extern void ktcp_sample_stop(struct ktcp_sampler *s);
+
+/*
+ * Send-side flow control. kget_sendq() reports bytes queued for sending
+ * and not yet acked (SIOCOUTQ) and of those, bytes not yet sent
+ * (SIOCOUTQNSD); datagram sockets report their send buffer use in both.
+ * kset_send_watermarks() sets TCP_NOTSENT_LOWAT to low and caps the send
+ * buffer at roughly high bytes; 0 leaves either alone.
+ *
+ * kset_writable_cb() calls fn from a workqueue when the socket becomes
+ * writable again after a send found it full (a non-blocking ksend()
+ * returned -EAGAIN), for TCP once unsent data is below the low mark.
+ * fn may sleep and send, but must not change the callback itself. NULL
+ * removes it. -EBUSY if something else owns the socket's callbacks,
+ * -EINVAL on a listening socket (and klisten() fails while one is set).
+ * It may be set before or after ktls_start(); once TLS is stacked on
+ * top, removing it only disarms fn and the hook is unwound on close.
+ */
+typedef void (*kwritable_fn_t)(ksocket_t socket, void *ctx);
+
+extern int kget_sendq(ksocket_t socket, int *queued, int *unsent);
+extern int kset_send_watermarks(ksocket_t socket, int low, int high);
+extern int kset_writable_cb(ksocket_t socket, kwritable_fn_t fn, void *ctx);
+
+/*
+ * Egress pacing and rate limits. kset_pacing_rate() caps a socket at
+ * rate bytes/s with SO_MAX_PACING_RATE, spread evenly by the stack.
+ *
+ * A kbucket is a token bucket of rate bytes/s and burst bytes that any
+ * number of sockets can share through kset_rate_limit() (NULL detaches)
+ * for an aggregate limit. Every send path (ksend(), ksendto(),
+ * ksendto_fanout() per datagram, kconnect_send(), ksend_tls_record() and
+ * krpc frames) waits for tokens, or fails with -EAGAIN under
+ * MSG_DONTWAIT; bytes a send did not get out are handed back. A wait
+ * ends early with -EBADF on kclose() and -EPIPE on kshutdown() of the
+ * send side. kbucket_throttled_ns() is the total time senders on a
+ * bucket waited. kbucket_set_rate() retunes it live,
+ * kbucket_destroy() drops the creator's reference.
+ */
+struct kbucket;
+
+extern int kset_pacing_rate(ksocket_t socket, unsigned long rate);
+extern struct kbucket *kbucket_create(unsigned long long rate, unsigned int burst);
+extern void kbucket_destroy(struct kbucket *b);
+extern int kbucket_set_rate(struct kbucket *b, unsigned long long rate, unsigned int burst);
+extern unsigned long long kbucket_throttled_ns(struct kbucket *b);
+extern int kset_rate_limit(ksocket_t socket, struct kbucket *b);
+
+/*
+ * Kernel TLS on a connected TCP ksocket. Keys come from a handshake done
+ * elsewhere; crypto_info is one of the struct tls12_crypto_info_* from
+ * <linux/tls.h> and direction is TLS_TX or TLS_RX.
+ */
+#define KTLS_RECORD_CHANGE_CIPHER_SPEC	20
+#define KTLS_RECORD_ALERT		21
+#define KTLS_RECORD_HANDSHAKE		22
+#define KTLS_RECORD_DATA		23
+
+extern int ktls_start(ksocket_t socket);
+extern int ktls_set_key(ksocket_t socket, int direction, const void *crypto_info, int length);
+extern ssize_t ksend_tls_record(ksocket_t socket, unsigned char record_type, const void *buffer, size_t length, int flags);
+extern ssize_t krecv_tls(ksocket_t socket, void *buffer, size_t length, int flags, unsigned char *record_type);
+
+/*
+ * Length-prefixed request/response over a connected stream ksocket.
+ * Any number of calls may be in flight on one connection; responses are
+ * matched back to their call by id. krpc does not own the socket: the
+ * caller kclose()s it. The one exception is a failed send, which leaves
+ * a partial frame on the stream, so krpc (client or krpc_serve()) shuts
+ * the socket down and the other side sees it close.
+ *
+ * krpc_serve() answers requests until the peer closes, an error, or,
+ * when it runs on a kthread, kthread_stop(). It may be called from any
+ * process context; elsewhere only closing the socket ends it.
+ */
+struct krpc;
+
+/* Async completion, may run in softirq context (timeouts): must not sleep */
+typedef void (*krpc_done_t)(void *ctx, ssize_t result);
+/* Returns response length written to resp, or a negative errno for the caller */
+typedef ssize_t (*krpc_handler_t)(void *ctx, const void *req, size_t req_len, void *resp, size_t resp_len);
+
+extern struct krpc *krpc_create(ksocket_t socket);
+extern void krpc_destroy(struct krpc *rpc);
+extern ssize_t krpc_call(struct krpc *rpc, const void *req, size_t req_len, void *resp, size_t resp_len, unsigned int timeout_ms);
+extern int krpc_call_async(struct krpc *rpc, const void *req, size_t req_len, void *resp, size_t resp_len, unsigned int timeout_ms, krpc_done_t done, void *ctx);
+extern int krpc_serve(ksocket_t socket, krpc_handler_t handler, void *ctx, size_t max_len);
+
 #endif /* !_ksocket_h_ */
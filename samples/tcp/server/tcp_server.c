@@ -8,29 +8,27 @@
 #include <linux/in.h>
 #include <linux/net.h>     
 #include <linux/socket.h>   
+#include <linux/string.h>
 #include "ksocket.h"   
 
 #define SERVER_PORT 12345
 #define BACKLOG     5
 #define RECV_BUF_SZ 1024
+#define DEFER_SECS  5
 
 static struct task_struct *server_thread;
 static ksocket_t listen_sock = NULL;
 
-static int tcp_server_thread(void *data) {
+static int tcp_server_setup(void) {
     struct sockaddr_in addr;
     int addrlen = sizeof(addr);
     int ret;
 
-    pr_info("tcp_server: thread starting (ksocket API)\n");
-
     /* Create listening socket via ksocket() */
     listen_sock = ksocket(AF_INET, SOCK_STREAM, 0);
-    if (IS_ERR(listen_sock)) {
-        long err = PTR_ERR(listen_sock);
-        pr_err("tcp_server: ksocket() failed: %ld\n", err);
-        listen_sock = NULL;
-        return (int)err;
+    if (!listen_sock) {
+        pr_err("tcp_server: ksocket() failed\n");
+        return -ENOMEM;
     }
 
     /* (Optional) allow immediate port reuse */
@@ -48,31 +46,45 @@ static int tcp_server_thread(void *data) {
     ret = kbind(listen_sock, (struct sockaddr *)&addr, addrlen);
     if (ret < 0) {
         pr_err("tcp_server: kbind() failed: %d\n", ret);
-        kclose(listen_sock);
-        listen_sock = NULL;
         return ret;
     }
 
-    ret = klisten(listen_sock, BACKLOG);
+    /* Only hand us connections that have already sent their request */
+    ret = klisten_defer(listen_sock, BACKLOG, DEFER_SECS);
     if (ret < 0) {
-        pr_err("tcp_server: klisten() failed: %d\n", ret);
-        kclose(listen_sock);
-        listen_sock = NULL;
+        pr_err("tcp_server: klisten_defer() failed: %d\n", ret);
         return ret;
     }
 
     pr_info("tcp_server: listening on port %d\n", SERVER_PORT);
+    return 0;
+}
+
+/* data is the thread's own reference on the listen socket */
+static int tcp_server_thread(void *data) {
+    ksocket_t lsock = data;
+    char *buf;
+
+    pr_info("tcp_server: thread starting (ksocket API)\n");
 
     /* Accept loop */
+    buf = kmalloc(RECV_BUF_SZ, GFP_KERNEL);
+    if (!buf) {
+        pr_err("tcp_server: kmalloc failed\n");
+        kput(lsock);
+        return -ENOMEM;
+    }
+
     while (!kthread_should_stop()) {
         ksocket_t client = NULL;
         struct sockaddr_in peer;
         int peerlen = sizeof(peer);
-        int n;
-        char *buf;
+        char peerstr[KSOCKADDR_STRLEN];
+        ssize_t n;
 
-        /* Accept (blocking) */
-        client = kaccept(listen_sock, (struct sockaddr *)&peer, &peerlen);
+        /* Accept (blocking) together with the first chunk of data */
+        client = kaccept_data(lsock, (struct sockaddr *)&peer, &peerlen,
+                              buf, RECV_BUF_SZ - 1, &n);
         if (IS_ERR_OR_NULL(client)) {
             long err = IS_ERR(client) ? PTR_ERR(client) : -ENOTCONN;
 
@@ -87,69 +99,76 @@ static int tcp_server_thread(void *data) {
             continue;
         }
 
-        pr_info("tcp_server: accepted client=%p\n", client);
+        if (ksockaddr_format((struct sockaddr *)&peer, peerstr, sizeof(peerstr)) < 0)
+            strscpy(peerstr, "?", sizeof(peerstr));
+        pr_info("tcp_server: accepted client=%p from %s\n", client, peerstr);
 
-        /* One recv then close (demo behavior) */
-        buf = kmalloc(RECV_BUF_SZ, GFP_KERNEL);
-        if (!buf) {
-            pr_err("tcp_server: kmalloc failed\n");
-            kclose(client);
-            continue;
-        }
-
-        n = krecv(client, buf, RECV_BUF_SZ - 1, 0);
+        /* One message then close (demo behavior); silent peers are dropped */
         if (n > 0) {
             buf[n] = '\0';
-            pr_info("tcp_server: received (%d bytes): %s\n", n, buf);
+            pr_info("tcp_server: received (%zd bytes): %s\n", n, buf);
         } else {
-            pr_info("tcp_server: krecv() returned %d\n", n);
+            pr_info("tcp_server: no data with connection (%zd), dropping\n", n);
         }
 
-        kfree(buf);
         kclose(client);
     }
 
-    /* Cleanup listening socket */
-    if (listen_sock) {
-        pr_info("tcp_server: closing listen socket %p\n", listen_sock);
-        kclose(listen_sock);
-        listen_sock = NULL;
-    }
+    kfree(buf);
+    kput(lsock);
 
     pr_info("tcp_server: thread exiting\n");
     return 0;
 }
 
 static int __init tcp_server_init(void) {
+    int ret;
+
     pr_info("tcp_server: Loading (starting thread)\n");
-    server_thread = kthread_run(tcp_server_thread, NULL, "tcp_server_thread");
+    ret = tcp_server_setup();
+    if (ret < 0)
+        goto fail;
+
+    server_thread = kthread_run(tcp_server_thread, khold(listen_sock), "tcp_server_thread");
     if (IS_ERR(server_thread)) {
-        int err = PTR_ERR(server_thread);
-        pr_err("tcp_server: kthread_run failed: %d\n", err);
+        ret = PTR_ERR(server_thread);
+        pr_err("tcp_server: kthread_run failed: %d\n", ret);
         server_thread = NULL;
-        return err;
+        kput(listen_sock);
+        goto fail;
     }
     return 0;
+
+fail:
+    if (listen_sock) {
+        kclose(listen_sock);
+        listen_sock = NULL;
+    }
+    return ret;
 }
 
 static void __exit tcp_server_exit(void) {
+    ksocket_t lsock = listen_sock;
+
     pr_info("tcp_server: Unloading\n");
 
-    /* Ask the listen socket to shut down so accept/recv unblocks */
+    /*
+     * Closing wakes the thread out of kaccept(); its own reference keeps
+     * the socket valid until it has noticed and dropped it.
+     */
     if (listen_sock) {
-        kshutdown(listen_sock, 2 /* SHUT_RDWR */);
+        pr_info("tcp_server: closing listen socket %p\n", listen_sock);
+        kclose(listen_sock);
+        listen_sock = NULL;
     }
 
     if (server_thread) {
-        kthread_stop(server_thread);
+        /* -EINTR: the thread never ran, so its reference is still ours */
+        if (kthread_stop(server_thread) == -EINTR)
+            kput(lsock);
         server_thread = NULL;
     }
 
-    if (listen_sock) {
-        kclose(listen_sock);
-        listen_sock = NULL;
-    }
-
     pr_info("tcp_server: Unloaded\n");
 }
 
@@ -16,7 +16,7 @@
 static struct task_struct *client_thread;
 
 static int udp_client_fn(void *data) {
-    struct socket *sock;
+    ksocket_t sock;
     struct sockaddr_in server_addr;
     char buffer[256];
     const char *message = "Hello UDP Server";
@@ -14,7 +14,7 @@ int udp_server_fn(void *data);
 static struct task_struct *server_thread;
 
 int udp_server_fn(void *data) {
-    struct socket *sock;
+    ksocket_t sock;
     struct sockaddr_in addr, src_addr;
     int ret, len;
     char buffer[256];
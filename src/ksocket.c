@@ -26,6 +26,50 @@
 #include <asm/processor.h>
 #include <asm/uaccess.h>
 #include <linux/uio.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/hashtable.h>
+#include <linux/timer.h>
+#include <linux/completion.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/refcount.h>
+#include <linux/tcp.h>
+#include <net/tcp.h>
+#include <linux/tls.h>
+#include <linux/udp.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
+#include <net/net_namespace.h>
+#include <net/busy_poll.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/wait.h>
+#include <linux/delay.h>
+#include <linux/workqueue.h>
+#include <net/inet_connection_sock.h>
+#include <net/tcp_states.h>
+#include <net/request_sock.h>
+#include <net/ipv6.h>
+#include <linux/in6.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
+#include <linux/log2.h>
+#include <linux/bvec.h>
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
+#include <linux/inet.h>
+#include <linux/bpf.h>
+#include <net/sock_reuseport.h>
+#include <linux/jhash.h>
+#include <linux/filter.h>
 #include "ksocket.h"
 
 #define KSOCKET_NAME	"ksocket"
@@ -39,8 +83,781 @@ MODULE_AUTHOR(KSOCKET_AUTHOR);
 MODULE_DESCRIPTION(KSOCKET_NAME"-"KSOCKET_VERSION"\n"KSOCKET_DESCPT);
 MODULE_LICENSE("Dual BSD/GPL");
 
+#ifndef ITER_SOURCE
+#define ITER_SOURCE	WRITE
+#define ITER_DEST	READ
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define timer_delete_sync	del_timer_sync
+#endif
+
+//statistics, summed over cpus by kget_stats() and shown in /proc/net/ksocket
+static DEFINE_PER_CPU(struct ksocket_stats, ksocket_stats);
+
+/* same order as struct ksocket_stats */
+static const char * const ksocket_stat_names[] = {
+	"busy_poll_hits",
+	"busy_poll_misses",
+	"affine_accepts",
+	"affine_fallbacks",
+	"tfo_connect_hits",
+	"tfo_connect_misses",
+	"tfo_accepts",
+	"accept_data_ready",
+	"accept_data_empty",
+	"idle_events",
+	"idle_closes",
+	"local_connects",
+	"ring_records",
+	"ring_full",
+	"fanout_datagrams",
+	"tcp_samples",
+	"tcp_sample_retrans",
+	"tcp_sample_bytes_acked",
+	"writable_events",
+	"throttle_waits",
+	"throttle_ns",
+	"reuseport_drained",
+};
+
+#define KSOCKET_STAT_INC(field)	this_cpu_inc(ksocket_stats.field)
+#define KSOCKET_STAT_ADD(field, n)	this_cpu_add(ksocket_stats.field, n)
+
+static void ktcp_samplers_show(struct seq_file *seq);
+
+void kget_stats(struct ksocket_stats *stats) {
+	const u64 *src;
+	u64 *dst = (u64 *)stats;
+	unsigned int i;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		src = (const u64 *)per_cpu_ptr(&ksocket_stats, cpu);
+		for (i = 0; i < ARRAY_SIZE(ksocket_stat_names); i++)
+			dst[i] += READ_ONCE(src[i]);
+	}
+}
+
+static int ksocket_stats_show(struct seq_file *seq, void *v) {
+	struct ksocket_stats stats;
+	const u64 *val = (const u64 *)&stats;
+	unsigned int i;
+
+	kget_stats(&stats);
+	for (i = 0; i < ARRAY_SIZE(ksocket_stat_names); i++)
+		seq_printf(seq, "%-24s %llu\n", ksocket_stat_names[i], val[i]);
+	ktcp_samplers_show(seq);
+	return 0;
+}
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+static bool ksocket_rx_ready(struct sock *sk) {
+	if (!skb_queue_empty_lockless(&sk->sk_receive_queue))
+		return true;
+	/* udp moves datagrams to a private reader queue on receive */
+	if (sk->sk_protocol == IPPROTO_UDP &&
+	    !skb_queue_empty_lockless(&udp_sk(sk)->reader_queue))
+		return true;
+	return READ_ONCE(sk->sk_err) || (READ_ONCE(sk->sk_shutdown) & RCV_SHUTDOWN);
+}
+
+/*
+ * Spin for up to the socket's SO_BUSY_POLL budget waiting for data before
+ * the receive path goes to sleep. A hit is a receive that never slept.
+ */
+static void ksocket_busy_wait(struct sock *sk) {
+	unsigned int budget = READ_ONCE(sk->sk_ll_usec);
+	u64 end;
+
+	if (!budget)
+		return;
+
+	end = local_clock() + (u64)budget * NSEC_PER_USEC;
+	while (!ksocket_rx_ready(sk)) {
+		if (sk_can_busy_loop(sk))
+			sk_busy_loop(sk, 1);
+		if (local_clock() >= end || need_resched() || signal_pending(current)) {
+			KSOCKET_STAT_INC(busy_poll_misses);
+			return;
+		}
+		cpu_relax();
+	}
+	KSOCKET_STAT_INC(busy_poll_hits);
+}
+#else
+static inline void ksocket_busy_wait(struct sock *sk) {
+}
+#endif
+
+//socket handles
+#define KSOCKET_CLOSING	0
+#define KSOCKET_SEND_SHUT	1	/* kshutdown() of the send side */
+
+/*
+ * What a ksocket_t points at. The creator owns one reference, dropped by
+ * kclose(); every call takes another for its duration, so a socket is
+ * only released once the last in-flight send/recv/accept has returned.
+ */
+struct ksocket {
+	struct socket *sock;
+	refcount_t ref;
+	unsigned long flags;
+	struct klocal_conn *local;	/* same-host peer, bypasses sock for data */
+	unsigned int local_side;
+	struct klocal_listener *listener;
+	struct kflow *flow;		/* writable callback, see kset_writable_cb() */
+	struct kbucket *bucket;		/* egress limit, see kset_rate_limit() */
+};
+
+static void klocal_close(ksocket_t socket);
+static void klocal_release(ksocket_t socket);
+static struct kflow *kflow_release(ksocket_t socket);
+static void kflow_reap(struct kflow *f);
+static struct kbucket *kbucket_charge(ksocket_t socket, size_t length, int flags, u64 *cost, int *err);
+static void kbucket_settle(struct kbucket *b, u64 cost, size_t length, ssize_t sent);
+
+/* senders throttled by a kbucket, woken early by kclose()/kshutdown() */
+static DECLARE_WAIT_QUEUE_HEAD(kbucket_wq);
+
+static ksocket_t ksocket_wrap(struct socket *sock) {
+	struct ksocket *h;
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (!h)
+		return NULL;
+
+	h->sock = sock;
+	refcount_set(&h->ref, 1);
+	return h;
+}
+
+/* Lock-free: a bit test and an atomic increment, NULL once closing */
+static struct socket *ksocket_get(ksocket_t socket) {
+	if (!socket || test_bit(KSOCKET_CLOSING, &socket->flags))
+		return NULL;
+	if (!refcount_inc_not_zero(&socket->ref))
+		return NULL;
+	return socket->sock;
+}
+
+static void ksocket_put(ksocket_t socket) {
+	struct kflow *parked;
+
+	if (refcount_dec_and_test(&socket->ref)) {
+		klocal_release(socket);
+		parked = kflow_release(socket);
+		kbucket_destroy(socket->bucket);
+		sock_release(socket->sock);
+		if (parked)
+			kflow_reap(parked);
+		kfree(socket);
+	}
+}
+
+ksocket_t khold(ksocket_t socket) {
+	return ksocket_get(socket) ? socket : NULL;
+}
+
+void kput(ksocket_t socket) {
+	if (socket)
+		ksocket_put(socket);
+}
+
+//same-host short-circuit transport
+#define KLOCAL_QUEUE_MAX	(256 << 10)
+#define KLOCAL_NAME_MAX		32
+
+/*
+ * A byte stream in one direction: writers copy into pages they own and
+ * queue references to the filled ranges, readers copy out and drop them.
+ */
+struct klocal_chunk {
+	struct list_head node;
+	struct page *page;
+	unsigned int off;
+	unsigned int len;
+};
+
+struct klocal_pipe {
+	spinlock_t lock;	/* chunks, queued, closed */
+	struct list_head chunks;
+	size_t queued;
+	bool closed;
+	struct mutex wlock;	/* one writer at a time, owns frag */
+	struct mutex rlock;	/* one reader at a time, owns the head chunk */
+	struct page *frag;
+	unsigned int frag_off;
+	unsigned long active;	/* jiffies of the last send or receive */
+	wait_queue_head_t wq;
+};
+
+/* pipe[0] carries connector to acceptor, pipe[1] the reverse */
+struct klocal_conn {
+	refcount_t ref;
+	struct klocal_pipe pipe[2];
+};
+
+struct klocal_pending {
+	struct list_head node;
+	struct klocal_conn *conn;
+};
+
+struct klocal_listener {
+	struct list_head node;
+	int family;
+	__be16 port;		/* 0 if not reachable over loopback */
+	char name[KLOCAL_NAME_MAX];
+	spinlock_t lock;
+	struct list_head pending;
+	unsigned int npending, backlog;	/* under lock, backlog as klisten() */
+	wait_queue_head_t wq;
+};
+
+static LIST_HEAD(klocal_listeners);
+static DEFINE_MUTEX(klocal_lock);
+
+static void klocal_pipe_init(struct klocal_pipe *p) {
+	spin_lock_init(&p->lock);
+	INIT_LIST_HEAD(&p->chunks);
+	mutex_init(&p->wlock);
+	mutex_init(&p->rlock);
+	p->active = jiffies;
+	init_waitqueue_head(&p->wq);
+}
+
+static void klocal_pipe_close(struct klocal_pipe *p) {
+	spin_lock(&p->lock);
+	p->closed = true;
+	spin_unlock(&p->lock);
+	wake_up_interruptible_all(&p->wq);
+}
+
+static void klocal_conn_put(struct klocal_conn *conn) {
+	struct klocal_chunk *c, *tmp;
+	int i;
+
+	if (!refcount_dec_and_test(&conn->ref))
+		return;
+
+	for (i = 0; i < 2; i++) {
+		list_for_each_entry_safe(c, tmp, &conn->pipe[i].chunks, node) {
+			put_page(c->page);
+			kfree(c);
+		}
+		if (conn->pipe[i].frag)
+			put_page(conn->pipe[i].frag);
+	}
+	kfree(conn);
+}
+
+static bool klocal_pipe_writable(struct klocal_pipe *p) {
+	return READ_ONCE(p->closed) || READ_ONCE(p->queued) < KLOCAL_QUEUE_MAX;
+}
+
+static ssize_t klocal_send(struct klocal_pipe *p, const void *buffer, size_t length, int flags) {
+	struct klocal_chunk *c;
+	size_t done = 0, n;
+	int ret = 0;
+
+	mutex_lock(&p->wlock);
+	while (done < length) {
+		if (!klocal_pipe_writable(p)) {
+			if (flags & MSG_DONTWAIT) {
+				ret = -EAGAIN;
+				break;
+			}
+			if (wait_event_interruptible(p->wq, klocal_pipe_writable(p))) {
+				ret = -EINTR;
+				break;
+			}
+		}
+		if (READ_ONCE(p->closed)) {
+			ret = -EPIPE;
+			break;
+		}
+
+		if (!p->frag || p->frag_off == PAGE_SIZE) {
+			if (p->frag)
+				put_page(p->frag);
+			p->frag = alloc_page(GFP_KERNEL);
+			p->frag_off = 0;
+			if (!p->frag) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		c = kmalloc(sizeof(*c), GFP_KERNEL);
+		if (!c) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		n = min_t(size_t, length - done, PAGE_SIZE - p->frag_off);
+		memcpy(page_address(p->frag) + p->frag_off, (const char *)buffer + done, n);
+		get_page(p->frag);
+		c->page = p->frag;
+		c->off = p->frag_off;
+		c->len = n;
+		p->frag_off += n;
+
+		spin_lock(&p->lock);
+		list_add_tail(&c->node, &p->chunks);
+		p->queued += n;
+		spin_unlock(&p->lock);
+		WRITE_ONCE(p->active, jiffies);
+		wake_up_interruptible_all(&p->wq);
+
+		done += n;
+	}
+	mutex_unlock(&p->wlock);
+
+	return done ? done : ret;
+}
+
+static bool klocal_pipe_readable(struct klocal_pipe *p) {
+	return READ_ONCE(p->closed) || !list_empty_careful(&p->chunks);
+}
+
+#define KLOCAL_RECV_FLAGS	(MSG_DONTWAIT | MSG_PEEK | MSG_WAITALL | MSG_NOSIGNAL)
+
+/* copy what is queued without consuming it; the lock keeps chunks in place */
+static size_t klocal_peek(struct klocal_pipe *p, void *buffer, size_t length) {
+	struct klocal_chunk *c;
+	size_t done = 0, n;
+
+	spin_lock(&p->lock);
+	list_for_each_entry(c, &p->chunks, node) {
+		if (done == length)
+			break;
+		n = min_t(size_t, length - done, c->len);
+		memcpy((char *)buffer + done, page_address(c->page) + c->off, n);
+		done += n;
+	}
+	spin_unlock(&p->lock);
+	return done;
+}
+
+/*
+ * Stream semantics like TCP: MSG_PEEK leaves the data queued,
+ * MSG_WAITALL keeps waiting until length bytes, EOF or a signal.
+ */
+static ssize_t klocal_recv(struct klocal_pipe *p, void *buffer, size_t length, int flags) {
+	struct klocal_chunk *c;
+	size_t done = 0, n;
+
+	if (flags & ~KLOCAL_RECV_FLAGS)
+		return -EOPNOTSUPP;
+	if (flags & (MSG_PEEK | MSG_DONTWAIT))
+		flags &= ~MSG_WAITALL;
+
+	mutex_lock(&p->rlock);
+	for (;;) {
+		if (!klocal_pipe_readable(p)) {
+			if (flags & MSG_DONTWAIT) {
+				mutex_unlock(&p->rlock);
+				return -EAGAIN;
+			}
+			if (wait_event_interruptible(p->wq, klocal_pipe_readable(p))) {
+				mutex_unlock(&p->rlock);
+				return done ? done : -EINTR;
+			}
+		}
+
+		if (flags & MSG_PEEK) {
+			done = klocal_peek(p, buffer, length);
+			break;
+		}
+
+		/* writers only append, so the head chunk is ours to copy unlocked */
+		while (done < length) {
+			spin_lock(&p->lock);
+			c = list_first_entry_or_null(&p->chunks, struct klocal_chunk, node);
+			spin_unlock(&p->lock);
+			if (!c)
+				break;
+
+			n = min_t(size_t, length - done, c->len);
+			memcpy((char *)buffer + done, page_address(c->page) + c->off, n);
+			c->off += n;
+			c->len -= n;
+			done += n;
+
+			spin_lock(&p->lock);
+			p->queued -= n;
+			if (!c->len)
+				list_del(&c->node);
+			spin_unlock(&p->lock);
+
+			if (!c->len) {
+				put_page(c->page);
+				kfree(c);
+			}
+		}
+		if (done) {
+			WRITE_ONCE(p->active, jiffies);
+			wake_up_interruptible_all(&p->wq);
+		}
+
+		if (!(flags & MSG_WAITALL) || done == length || READ_ONCE(p->closed))
+			break;
+	}
+	mutex_unlock(&p->rlock);
+	return done;
+}
+
+static struct klocal_pipe *klocal_tx(ksocket_t socket) {
+	return &socket->local->pipe[socket->local_side];
+}
+
+static struct klocal_pipe *klocal_rx(ksocket_t socket) {
+	return &socket->local->pipe[!socket->local_side];
+}
+
+static void klocal_shutdown(ksocket_t socket, int how) {
+	if (how == SHUT_RD || how == SHUT_RDWR)
+		klocal_pipe_close(klocal_rx(socket));
+	if (how == SHUT_WR || how == SHUT_RDWR)
+		klocal_pipe_close(klocal_tx(socket));
+}
+
+static struct klocal_listener *klocal_find(int family, __be16 port, const char *name) {
+	struct klocal_listener *l;
+
+	list_for_each_entry(l, &klocal_listeners, node) {
+		if (name && !strcmp(l->name, name))
+			return l;
+		if (!name && port && l->family == family && l->port == port)
+			return l;
+	}
+	return NULL;
+}
+
+static bool klocal_is_loopback(const struct sockaddr *address, int address_len, __be16 *port) {
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)address;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)address;
+
+	if (address->sa_family == AF_INET && address_len >= (int)sizeof(*sin)) {
+		*port = sin->sin_port;
+		return ipv4_is_loopback(sin->sin_addr.s_addr);
+	}
+#if IS_ENABLED(CONFIG_IPV6)
+	if (address->sa_family == AF_INET6 && address_len >= (int)sizeof(*sin6)) {
+		*port = sin6->sin6_port;
+		return ipv6_addr_loopback(&sin6->sin6_addr);
+	}
+#endif
+	return false;
+}
+
+/* -ENOENT when there is no local listener and the caller should use TCP */
+static int klocal_connect_to(ksocket_t socket, int family, __be16 port, const char *name) {
+	struct klocal_pending *pend;
+	struct klocal_listener *l;
+	struct klocal_conn *conn;
+	int ret = 0;
+
+	if (socket->sock->type != SOCK_STREAM)
+		return -ENOENT;
+	if (READ_ONCE(socket->local))
+		return -EISCONN;
+
+	conn = kzalloc(sizeof(*conn), GFP_KERNEL);
+	pend = kmalloc(sizeof(*pend), GFP_KERNEL);
+	if (!conn || !pend) {
+		kfree(conn);
+		kfree(pend);
+		return -ENOMEM;
+	}
+	refcount_set(&conn->ref, 2);
+	klocal_pipe_init(&conn->pipe[0]);
+	klocal_pipe_init(&conn->pipe[1]);
+	pend->conn = conn;
+
+	mutex_lock(&klocal_lock);
+	l = klocal_find(family, port, name);
+	if (!l) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	spin_lock(&l->lock);
+	if (l->npending >= l->backlog) {
+		ret = -ECONNREFUSED;
+	} else if (cmpxchg_release(&socket->local, NULL, conn)) {
+		/* lost to a concurrent connect on the same handle */
+		ret = -EISCONN;
+	} else {
+		list_add_tail(&pend->node, &l->pending);
+		l->npending++;
+	}
+	spin_unlock(&l->lock);
+	if (ret == 0)
+		wake_up_interruptible_all(&l->wq);
+unlock:
+	mutex_unlock(&klocal_lock);
+
+	if (ret < 0) {
+		kfree(conn);
+		kfree(pend);
+		return ret;
+	}
+	KSOCKET_STAT_INC(local_connects);
+	return 0;
+}
+
+static int klocal_connect_addr(ksocket_t socket, struct sockaddr *address, int address_len) {
+	__be16 port;
+
+	if (!address || !klocal_is_loopback(address, address_len, &port))
+		return -ENOENT;
+	return klocal_connect_to(socket, address->sa_family, port, NULL);
+}
+
+/* what kaccept() reports as the peer of a same-host connection */
+static int klocal_peer_addr(int family, struct sockaddr *address) {
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)address;
+	struct sockaddr_in *sin = (struct sockaddr_in *)address;
+
+	if (family == AF_INET6) {
+		memset(sin6, 0, sizeof(*sin6));
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr.s6_addr[15] = 1;	/* ::1 */
+		return sizeof(*sin6);
+	}
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return sizeof(*sin);
+}
+
+static bool klocal_accept_ready(ksocket_t socket) {
+	struct sock *sk = socket->sock->sk;
+
+	return !list_empty_careful(&socket->listener->pending) ||
+	       !reqsk_queue_empty(&inet_csk(sk)->icsk_accept_queue) ||
+	       READ_ONCE(sk->sk_state) != TCP_LISTEN ||
+	       test_bit(KSOCKET_CLOSING, &socket->flags);
+}
+
+/*
+ * Accept from whichever queue has something: wait on both the listener's
+ * own wait queue (TCP) and the local one, then take the connection.
+ */
+static ksocket_t klocal_accept(ksocket_t socket, int *err) {
+	struct klocal_listener *l = socket->listener;
+	struct socket *sk = socket->sock;
+	wait_queue_entry_t wait_tcp, wait_local;
+	struct klocal_pending *pend;
+	struct socket *new_sk;
+	ksocket_t handle;
+
+	for (;;) {
+		init_waitqueue_entry(&wait_tcp, current);
+		init_waitqueue_entry(&wait_local, current);
+		add_wait_queue(sk_sleep(sk->sk), &wait_tcp);
+		add_wait_queue(&l->wq, &wait_local);
+		for (;;) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (klocal_accept_ready(socket) || signal_pending(current))
+				break;
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+		remove_wait_queue(&l->wq, &wait_local);
+		remove_wait_queue(sk_sleep(sk->sk), &wait_tcp);
+
+		if (test_bit(KSOCKET_CLOSING, &socket->flags)) {
+			*err = -EBADF;
+			return NULL;
+		}
+
+		spin_lock(&l->lock);
+		pend = list_first_entry_or_null(&l->pending, struct klocal_pending, node);
+		if (pend) {
+			list_del(&pend->node);
+			l->npending--;
+		}
+		spin_unlock(&l->lock);
+
+		if (pend) {
+			/* an unconnected socket keeps the non-data calls working */
+			*err = sock_create(sk->sk->sk_family, SOCK_STREAM, IPPROTO_TCP, &new_sk);
+			if (*err < 0) {
+				klocal_pipe_close(&pend->conn->pipe[0]);
+				klocal_pipe_close(&pend->conn->pipe[1]);
+				klocal_conn_put(pend->conn);
+				kfree(pend);
+				return NULL;
+			}
+			handle = ksocket_wrap(new_sk);
+			if (!handle) {
+				sock_release(new_sk);
+				klocal_pipe_close(&pend->conn->pipe[0]);
+				klocal_pipe_close(&pend->conn->pipe[1]);
+				klocal_conn_put(pend->conn);
+				kfree(pend);
+				*err = -ENOMEM;
+				return NULL;
+			}
+			handle->local = pend->conn;
+			handle->local_side = 1;
+			kfree(pend);
+			return handle;
+		}
+
+		if (signal_pending(current)) {
+			*err = -EINTR;
+			return NULL;
+		}
+
+		*err = kernel_accept(sk, &new_sk, O_NONBLOCK);
+		if (*err == -EAGAIN)
+			continue;	/* another acceptor was faster */
+		if (*err < 0)
+			return NULL;
+
+		handle = ksocket_wrap(new_sk);
+		if (!handle) {
+			sock_release(new_sk);
+			*err = -ENOMEM;
+		}
+		return handle;
+	}
+}
+
+static void klocal_unlisten(struct klocal_listener *l) {
+	struct klocal_pending *pend, *tmp;
+
+	mutex_lock(&klocal_lock);
+	list_del_init(&l->node);
+	mutex_unlock(&klocal_lock);
+
+	/* connectors that were never accepted see EOF / EPIPE */
+	list_for_each_entry_safe(pend, tmp, &l->pending, node) {
+		list_del(&pend->node);
+		l->npending--;
+		klocal_pipe_close(&pend->conn->pipe[0]);
+		klocal_pipe_close(&pend->conn->pipe[1]);
+		klocal_conn_put(pend->conn);
+		kfree(pend);
+	}
+	wake_up_interruptible_all(&l->wq);
+}
+
+/* kclose(): stop new local connections and wake local waiters */
+static void klocal_close(ksocket_t socket) {
+	if (socket->listener) {
+		mutex_lock(&klocal_lock);
+		list_del_init(&socket->listener->node);
+		mutex_unlock(&klocal_lock);
+		wake_up_interruptible_all(&socket->listener->wq);
+	}
+	if (socket->local)
+		klocal_shutdown(socket, SHUT_RDWR);
+}
+
+/* last reference gone */
+static void klocal_release(ksocket_t socket) {
+	if (socket->listener) {
+		klocal_unlisten(socket->listener);
+		kfree(socket->listener);
+	}
+	if (socket->local) {
+		klocal_shutdown(socket, SHUT_RDWR);
+		klocal_conn_put(socket->local);
+	}
+}
+
+int klocal_listen(ksocket_t socket, const char *name) {
+	struct sockaddr_storage addr;
+	struct klocal_listener *l;
+	struct socket *sk;
+	int ret;
+
+	if (name && strlen(name) >= KLOCAL_NAME_MAX)
+		return -ENAMETOOLONG;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+	if (sk->sk->sk_state != TCP_LISTEN || socket->listener) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = kernel_getsockname(sk, (struct sockaddr *)&addr);
+	if (ret < 0)
+		goto out;
+
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (!l) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	l->family = addr.ss_family;
+	l->backlog = max_t(u32, READ_ONCE(sk->sk->sk_max_ack_backlog), 1);
+	spin_lock_init(&l->lock);
+	INIT_LIST_HEAD(&l->pending);
+	init_waitqueue_head(&l->wq);
+	if (name)
+		strscpy(l->name, name, sizeof(l->name));
+
+	/* only wildcard or loopback binds are what a 127.0.0.1/::1 peer reaches */
+	if (addr.ss_family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+
+		if (sin->sin_addr.s_addr == htonl(INADDR_ANY) ||
+		    ipv4_is_loopback(sin->sin_addr.s_addr))
+			l->port = sin->sin_port;
+	}
+#if IS_ENABLED(CONFIG_IPV6)
+	else if (addr.ss_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+
+		if (ipv6_addr_any(&sin6->sin6_addr) || ipv6_addr_loopback(&sin6->sin6_addr))
+			l->port = sin6->sin6_port;
+	}
+#endif
+
+	mutex_lock(&klocal_lock);
+	if (klocal_find(l->family, l->port, NULL) || (name && klocal_find(0, 0, name))) {
+		mutex_unlock(&klocal_lock);
+		kfree(l);
+		ret = -EADDRINUSE;
+		goto out;
+	}
+	list_add(&l->node, &klocal_listeners);
+	socket->listener = l;
+	mutex_unlock(&klocal_lock);
+	ret = 0;
+out:
+	ksocket_put(socket);
+	return ret;
+}
+
+int klocal_connect(ksocket_t socket, const char *name, struct sockaddr *fallback, int fallback_len) {
+	int ret;
+
+	if (!ksocket_get(socket))
+		return -EBADF;
+	if (name)
+		ret = klocal_connect_to(socket, 0, 0, name);
+	else
+		ret = klocal_connect_addr(socket, fallback, fallback_len);
+	ksocket_put(socket);
+
+	/* not a local service: the explicit fallback goes over the network */
+	if (ret == -ENOENT && fallback)
+		ret = kconnect(socket, fallback, fallback_len);
+	return ret;
+}
+
 ksocket_t ksocket(int domain, int type, int protocol) {
 	struct socket *sk = NULL;
+	ksocket_t handle;
 	int ret = 0;
 	
 	ret = sock_create(domain, type, protocol, &sk);
@@ -49,19 +866,29 @@ ksocket_t ksocket(int domain, int type, int protocol) {
 		return NULL;
 	}
 
+	handle = ksocket_wrap(sk);
+	if (!handle) {
+		sock_release(sk);
+		return NULL;
+	}
+
 	printk("sock_create sk= 0x%p\n", sk);
 	
-	return sk;
+	return handle;
 }
 
 int kbind(ksocket_t socket, struct sockaddr *address, int address_len) {
 	struct socket *sk;
 	int ret = 0;
 
-	sk = (struct socket *)socket;
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
 	ret = sk->ops->bind(sk, address, address_len);
 	printk("kbind ret = %d\n", ret);
 	
+	ksocket_put(socket);
 	return ret;
 }
 
@@ -69,14 +896,23 @@ int klisten(ksocket_t socket, int backlog) {
 	struct socket *sk;
 	int ret;
 
-	sk = (struct socket *)socket;
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
 	
 	if ((unsigned)backlog > SOMAXCONN) {
 		backlog = SOMAXCONN;
 	}
+
+	/* accepted children would inherit the hook, see kset_writable_cb() */
+	if (READ_ONCE(socket->flow)) {
+		ksocket_put(socket);
+		return -EINVAL;
+	}
 	
 	ret = sk->ops->listen(sk, backlog);
 	
+	ksocket_put(socket);
 	return ret;
 }
 
@@ -84,70 +920,135 @@ int kconnect(ksocket_t socket, struct sockaddr *address, int address_len) {
 	struct socket *sk;
 	int ret;
 
-	sk = (struct socket *)socket;
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
 	ret = sk->ops->connect(sk, address, address_len, 0/*sk->file->f_flags*/);
 	
+	ksocket_put(socket);
 	return ret;
 }
 
 ksocket_t kaccept(ksocket_t socket, struct sockaddr *address, int *address_len) {
-    struct socket *sk = (struct socket *)socket;
+    struct socket *sk;
     struct socket *new_sk = NULL;
+    ksocket_t handle = NULL;
     int ret;
 
+    sk = ksocket_get(socket);
+    if (!sk)
+        return NULL;
+
     printk("family = %d, type = %d, protocol = %d\n",
            sk->sk->sk_family, sk->type, sk->sk->sk_protocol);
 
-    // Create a new socket
-    ret = sock_create(sk->sk->sk_family, sk->type, sk->sk->sk_protocol, &new_sk);
-    if (ret < 0 || !new_sk)
-        return NULL;
+    // Listener also takes same-host connections
+    if (socket->listener) {
+        handle = klocal_accept(socket, &ret);
+        if (!handle)
+            goto out;
+        if (handle->local) {
+            // No wire address: the peer is this host's loopback
+            if (address) {
+                ret = klocal_peer_addr(socket->listener->family, address);
+                if (address_len)
+                    *address_len = ret;
+            }
+            goto out;
+        }
+        new_sk = handle->sock;
+        goto accepted;
+    }
 
-    new_sk->type = sk->type;
-    new_sk->ops = sk->ops;
+    // Accept connection; kernel_accept() tracks the ->accept() signature across versions
+    ret = kernel_accept(sk, &new_sk, 0);
+    if (ret < 0)
+        goto out;
 
-    // Accept connection
-    ret = sk->ops->accept(sk, new_sk, 0 /*sk->file->f_flags*/);
-    if (ret < 0) {
+    handle = ksocket_wrap(new_sk);
+    if (!handle) {
         sock_release(new_sk);
-        return NULL;
+        goto out;
     }
 
+accepted:
     // Retrieve peer address if requested
     if (address) {
         ret = new_sk->ops->getname(new_sk, address, 1);
         if (ret < 0) {
-            sock_release(new_sk);
-            return NULL;
+            ksocket_put(handle);
+            handle = NULL;
+            goto out;
         }
+        if (address_len)
+            *address_len = ret;
     }
 
-    return new_sk;
+    // Data already queued from the SYN means a fast open child
+    if (new_sk->sk->sk_protocol == IPPROTO_TCP && tcp_sk(new_sk->sk)->syn_data_acked)
+        KSOCKET_STAT_INC(tfo_accepts);
+
+out:
+    ksocket_put(socket);
+    return handle;
 }
 
 ssize_t krecv(ksocket_t socket, void *buffer, size_t length, int flags) {
-    struct socket *sk = (struct socket *)socket;
+    struct socket *sk;
     struct msghdr msg = { 0 };
     struct kvec iov;
+    int ret;
+
+    sk = ksocket_get(socket);
+    if (!sk)
+        return -EBADF;
+
+    if (socket->local) {
+        ret = klocal_recv(klocal_rx(socket), buffer, length, flags);
+        ksocket_put(socket);
+        return ret;
+    }
 
     iov.iov_base = buffer;
     iov.iov_len = length;
 
-    return kernel_recvmsg(sk, &msg, &iov, 1, length, flags);
+    if (!(flags & MSG_DONTWAIT))
+        ksocket_busy_wait(sk->sk);
+
+    ret = kernel_recvmsg(sk, &msg, &iov, 1, length, flags);
+    ksocket_put(socket);
+    return ret;
 }
 
 ssize_t ksend(ksocket_t socket, const void *buffer, size_t length, int flags) {
 	struct socket *sk;
 	struct msghdr msg = {0};
 	struct kvec iov;
+	struct kbucket *b;
+	u64 cost;
 	int len;
 
-	sk = (struct socket *)socket;
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
 
-	iov.iov_base = (void *)buffer;
-	iov.iov_len = length;
+	b = kbucket_charge(socket, length, flags, &cost, &len);
+	if (len < 0) {
+		ksocket_put(socket);
+		return len;
+	}
 
-	len = kernel_sendmsg(sk, &msg, &iov, 1, length);
+	if (socket->local) {
+		len = klocal_send(klocal_tx(socket), buffer, length, flags);
+	} else {
+		iov.iov_base = (void *)buffer;
+		iov.iov_len = length;
+
+		len = kernel_sendmsg(sk, &msg, &iov, 1, length);
+	}
+	kbucket_settle(b, cost, length, len);
+	ksocket_put(socket);
 	return len;
 }
 
@@ -155,25 +1056,37 @@ int kshutdown(ksocket_t socket, int how) {
 	struct socket *sk;
 	int ret = 0;
 
-	sk = (struct socket *)socket;
+	sk = ksocket_get(socket);
 	if (sk) {
+		if (socket->local)
+			klocal_shutdown(socket, how);
 		ret = sk->ops->shutdown(sk, how);
+		if (socket->local)
+			ret = 0;
+		if (how != SHUT_RD) {
+			set_bit(KSOCKET_SEND_SHUT, &socket->flags);
+			wake_up_interruptible_all(&kbucket_wq);
+		}
+		ksocket_put(socket);
 	}
 	return ret;
 }
 
-//TODO: ?
 int kclose(ksocket_t socket) {
-	struct socket *sk;
-	int ret;
-
-	sk = (struct socket *)socket;
-	ret = sk->ops->release(sk);
+	if (!socket)
+		return -EBADF;
+	if (test_and_set_bit(KSOCKET_CLOSING, &socket->flags))
+		return -EBADF;
 
-	if (sk) {
-		sock_release(sk);
-        }
-	return ret;
+	/*
+	 * Wake anyone still blocked in accept/recv on this socket; they fail
+	 * or see EOF and drop their references, the last one releases it.
+	 */
+	klocal_close(socket);
+	kernel_sock_shutdown(socket->sock, SHUT_RDWR);
+	wake_up_interruptible_all(&kbucket_wq);
+	ksocket_put(socket);
+	return 0;
 }
 
 ssize_t krecvfrom(ksocket_t socket, void *buffer, size_t length,
@@ -183,7 +1096,15 @@ ssize_t krecvfrom(ksocket_t socket, void *buffer, size_t length,
 	struct kvec iov;
 	int ret;
 
-	sk = (struct socket *)socket;
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	if (socket->local) {
+		ret = klocal_recv(klocal_rx(socket), buffer, length, flags);
+		ksocket_put(socket);
+		return ret;
+	}
 
 	// Set up kvec for kernel buffer
 	iov.iov_base = buffer;
@@ -195,22 +1116,45 @@ ssize_t krecvfrom(ksocket_t socket, void *buffer, size_t length,
 		msg.msg_namelen = *address_len;
 	}
 
+	if (!(flags & MSG_DONTWAIT))
+		ksocket_busy_wait(sk->sk);
+
 	ret = kernel_recvmsg(sk, &msg, &iov, 1, length, flags);
 
 	// Update actual received address length
 	if (ret >= 0 && address_len && msg.msg_namelen > 0) {
 		*address_len = msg.msg_namelen;
 	}
+	ksocket_put(socket);
 	return ret;
 }
 
 ssize_t ksendto(ksocket_t socket, void *message, size_t length,
                 int flags, const struct sockaddr *dest_addr, int dest_len) {
-	struct socket *sk = (struct socket *)socket;
+	struct socket *sk;
 	struct msghdr msg = {0};
 	struct kvec iov;
+	struct kbucket *b;
+	u64 cost;
 	int ret;
 
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	b = kbucket_charge(socket, length, flags, &cost, &ret);
+	if (ret < 0) {
+		ksocket_put(socket);
+		return ret;
+	}
+
+	if (socket->local) {
+		ret = klocal_send(klocal_tx(socket), message, length, flags);
+		kbucket_settle(b, cost, length, ret);
+		ksocket_put(socket);
+		return ret;
+	}
+
 	// Set up kvec for kernel-safe buffer
 	iov.iov_base = message;
 	iov.iov_len = length;
@@ -225,15 +1169,26 @@ ssize_t ksendto(ksocket_t socket, void *message, size_t length,
 
 	// Use kernel_sendmsg for modern compatibility
 	ret = kernel_sendmsg(sk, &msg, &iov, 1, length);
+	kbucket_settle(b, cost, length, ret);
+	ksocket_put(socket);
 	return ret;
 }
 
 int kgetsockname(ksocket_t socket, struct sockaddr *address, int *address_len) {
-	struct socket *sk = (struct socket *)socket;
+	struct socket *sk;
 	struct sockaddr_storage addr;
 	int ret;
 
-	ret = kernel_getsockname(sk, (struct sockaddr *)&addr);
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	/* same-host connections have no addresses of their own */
+	if (socket->local)
+		ret = -ENOTCONN;
+	else
+		ret = kernel_getsockname(sk, (struct sockaddr *)&addr);
+	ksocket_put(socket);
 	if (ret < 0) {
 		return ret;
 	}
@@ -248,11 +1203,20 @@ int kgetsockname(ksocket_t socket, struct sockaddr *address, int *address_len) {
 }
 
 int kgetpeername(ksocket_t socket, struct sockaddr *address, int *address_len) {
-	struct socket *sk = (struct socket *)socket;
+	struct socket *sk;
 	struct sockaddr_storage addr;
 	int ret;
 
-	ret = kernel_getpeername(sk, (struct sockaddr *)&addr);
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	/* same-host connections have no addresses of their own */
+	if (socket->local)
+		ret = -ENOTCONN;
+	else
+		ret = kernel_getpeername(sk, (struct sockaddr *)&addr);
+	ksocket_put(socket);
 	if (ret < 0) {
 		return ret;
 	}
@@ -266,78 +1230,2826 @@ int kgetpeername(ksocket_t socket, struct sockaddr *address, int *address_len) {
 }
 
 int ksetsockopt(ksocket_t socket, int level, int optname, void *optval, int optlen) {
-	struct socket *sk = (struct socket *)socket;
+	struct socket *sk;
 	sockptr_t opt_ptr;
 	int ret;
 
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
 	// Wrap kernel pointer as a safe sockptr_t
 	opt_ptr = KERNEL_SOCKPTR(optval);
 
-	if (level == SOL_SOCKET) {
+	// A same-host connection has no TCP (or TLS) state to configure
+	if (socket->local && (level == SOL_TCP || level == SOL_TLS))
+		ret = -EOPNOTSUPP;
+	else if (level == SOL_SOCKET) {
 		ret = sock_setsockopt(sk, level, optname, opt_ptr, optlen);
 	}
 	else {
 		ret = sk->ops->setsockopt(sk, level, optname, opt_ptr, optlen);
 	}
+	ksocket_put(socket);
 	return ret;
 }
 
-int kgetsockopt(ksocket_t socket, int level, int optname, void *optval, int *optlen) {
-	struct socket *sk = (struct socket *)socket;
-	int ret;
+/*
+ * ops->getsockopt() copies out to user pointers and modules get no
+ * sockptr_t variant, so the options kernel callers need are read here
+ * straight from the sock.
+ */
+static int kgetsockopt_int(struct sock *sk, int level, int optname, int *val) {
+	if (level == SOL_SOCKET) {
+		switch (optname) {
+		case SO_TYPE:
+			*val = sk->sk_type;
+			return 0;
+		case SO_PROTOCOL:
+			*val = sk->sk_protocol;
+			return 0;
+		case SO_ERROR:
+			*val = -sock_error(sk);
+			return 0;
+		case SO_RCVBUF:
+			*val = READ_ONCE(sk->sk_rcvbuf);
+			return 0;
+		case SO_SNDBUF:
+			*val = READ_ONCE(sk->sk_sndbuf);
+			return 0;
+		case SO_KEEPALIVE:
+			*val = sock_flag(sk, SOCK_KEEPOPEN);
+			return 0;
+		case SO_REUSEADDR:
+			*val = sk->sk_reuse;
+			return 0;
+		case SO_REUSEPORT:
+			*val = sk->sk_reuseport;
+			return 0;
+		case SO_PRIORITY:
+			*val = READ_ONCE(sk->sk_priority);
+			return 0;
+		case SO_INCOMING_CPU:
+			*val = READ_ONCE(sk->sk_incoming_cpu);
+			return 0;
+		}
+	} else if (level == SOL_TCP && sk->sk_protocol == IPPROTO_TCP) {
+		switch (optname) {
+		case TCP_NODELAY:
+			*val = !!(tcp_sk(sk)->nonagle & TCP_NAGLE_OFF);
+			return 0;
+		case TCP_MAXSEG:
+			*val = READ_ONCE(tcp_sk(sk)->mss_cache);
+			return 0;
+		}
+	}
+	return -ENOPROTOOPT;
+}
+
+int kgetsockopt(ksocket_t socket, int level, int optname, void *optval, int *optlen) {
+	struct socket *sk;
+	struct tcp_info info;
+	int val, len, ret;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	if (*optlen < 0) {
+		ret = -EINVAL;
+	} else if (socket->local && level == SOL_TCP &&
+		   (optname == TCP_INFO || optname == TCP_CONGESTION)) {
+		/* same-host connections never touch the TCP stack */
+		ret = -EOPNOTSUPP;
+	} else if (level == SOL_TCP && optname == TCP_INFO) {
+		if (sk->sk->sk_protocol != IPPROTO_TCP) {
+			ret = -ENOPROTOOPT;
+		} else {
+			tcp_get_info(sk->sk, &info);
+			len = min_t(int, *optlen, sizeof(info));
+			memcpy(optval, &info, len);
+			*optlen = len;
+			ret = 0;
+		}
+	} else if (level == SOL_TCP && optname == TCP_CONGESTION) {
+		if (sk->sk->sk_protocol != IPPROTO_TCP) {
+			ret = -ENOPROTOOPT;
+		} else {
+			char name[TCP_CA_NAME_MAX] = "";
+
+			lock_sock(sk->sk);
+			if (inet_csk(sk->sk)->icsk_ca_ops)
+				strscpy(name, inet_csk(sk->sk)->icsk_ca_ops->name, sizeof(name));
+			release_sock(sk->sk);
+			len = min_t(int, *optlen, sizeof(name));
+			memcpy(optval, name, len);
+			*optlen = len;
+			ret = 0;
+		}
+	} else {
+		ret = kgetsockopt_int(sk->sk, level, optname, &val);
+		if (ret == 0) {
+			if (*optlen < (int)sizeof(val)) {
+				ret = -EINVAL;
+			} else {
+				memcpy(optval, &val, sizeof(val));
+				*optlen = sizeof(val);
+			}
+		}
+	}
+
+	ksocket_put(socket);
+	return ret;
+}
+
+//busy polling
+int kset_busy_poll(ksocket_t socket, unsigned int usecs, int prefer) {
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	int val = usecs;
+	int ret;
+
+	if (usecs > INT_MAX)
+		return -EINVAL;
+
+	/* sk_ll_usec doubles as the krecv()/krecvfrom() spin budget */
+	ret = ksetsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val));
+	if (ret < 0)
+		return ret;
+
+	val = usecs && prefer;
+	return ksetsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val));
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+//cpu/numa affine connection placement
+int kget_incoming_cpu(ksocket_t socket) {
+	struct socket *sk;
+	int cpu;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -1;
+
+	cpu = READ_ONCE(sk->sk->sk_incoming_cpu);
+	ksocket_put(socket);
+	return cpu;
+}
+
+int kget_numa_node(ksocket_t socket) {
+	int cpu = kget_incoming_cpu(socket);
+
+	if (cpu < 0 || cpu >= (int)nr_cpu_ids)
+		return NUMA_NO_NODE;
+	return cpu_to_node(cpu);
+}
+
+void *kalloc_local(ksocket_t socket, size_t size, gfp_t flags) {
+	return kmalloc_node(size, flags, kget_numa_node(socket));
+}
+
+struct kserver_conn {
+	struct list_head node;
+	ksocket_t sock;
+};
+
+struct kserver_worker {
+	struct kserver *srv;
+	struct task_struct *task;
+	spinlock_t lock;
+	struct list_head queue;
+	struct kserver_conn *active;	/* in the handler, under lock */
+	wait_queue_head_t wq;
+	int node;
+};
+
+struct kserver {
+	ksocket_t listener;	/* our own reference */
+	struct task_struct *acceptor;
+	struct completion accept_done;	/* acceptor is out of kaccept() for good */
+	bool stopping;
+	struct kserver_worker **workers;	/* indexed by cpu, NULL if none */
+	unsigned int rr;
+	kserver_handler_t handler;
+	void *ctx;
+	size_t buf_len;
+};
+
+static void kserver_close_conn(struct kserver_conn *conn) {
+	kclose(conn->sock);
+	kfree(conn);
+}
+
+static int kserver_worker_fn(void *data) {
+	struct kserver_worker *w = data;
+	struct kserver *srv = w->srv;
+	struct kserver_conn *conn, *tmp;
+	void *buf;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(w->wq, !list_empty_careful(&w->queue) ||
+					 kthread_should_stop());
+
+		spin_lock_bh(&w->lock);
+		conn = list_first_entry_or_null(&w->queue, struct kserver_conn, node);
+		if (conn) {
+			list_del(&conn->node);
+			/* kserver_stop() shuts down whatever is active */
+			if (!READ_ONCE(srv->stopping))
+				w->active = conn;
+		}
+		spin_unlock_bh(&w->lock);
+		if (!conn)
+			continue;
+
+		if (w->active) {
+			/* the buffer lives on the node the flow's packets arrive on */
+			buf = kmalloc_node(srv->buf_len, GFP_KERNEL, w->node);
+			if (buf)
+				srv->handler(srv->ctx, conn->sock, buf, srv->buf_len);
+			kfree(buf);
+
+			spin_lock_bh(&w->lock);
+			w->active = NULL;
+			spin_unlock_bh(&w->lock);
+		}
+		kserver_close_conn(conn);
+	}
+
+	list_for_each_entry_safe(conn, tmp, &w->queue, node) {
+		list_del(&conn->node);
+		kserver_close_conn(conn);
+	}
+	return 0;
+}
+
+/* Same cpu if we run a worker there, else one on the same node, else any */
+static struct kserver_worker *kserver_pick(struct kserver *srv, int cpu) {
+	struct kserver_worker *w;
+	unsigned int i;
+	int node;
+
+	if (cpu >= 0 && cpu < (int)nr_cpu_ids) {
+		w = srv->workers[cpu];
+		if (w)
+			return w;
+
+		node = cpu_to_node(cpu);
+		for_each_cpu(i, cpumask_of_node(node)) {
+			if (srv->workers[i])
+				return srv->workers[i];
+		}
+	}
+
+	KSOCKET_STAT_INC(affine_fallbacks);
+	for (i = 0; i < nr_cpu_ids; i++) {
+		w = srv->workers[(srv->rr++ + i) % nr_cpu_ids];
+		if (w)
+			return w;
+	}
+	return NULL;
+}
+
+static int kserver_acceptor_fn(void *data) {
+	struct kserver *srv = data;
+	struct kserver_worker *w;
+	struct kserver_conn *conn;
+	ksocket_t client;
+
+	/* kserver_stop() interrupts kaccept() with a signal, not a shutdown */
+	allow_signal(SIGKILL);
+
+	while (!READ_ONCE(srv->stopping)) {
+		client = kaccept(srv->listener, NULL, NULL);
+		if (READ_ONCE(srv->stopping)) {
+			if (client)
+				kclose(client);
+			break;
+		}
+		if (!client) {
+			flush_signals(current);
+			msleep(100);
+			continue;
+		}
+
+		w = kserver_pick(srv, kget_incoming_cpu(client));
+		conn = w ? kmalloc_node(sizeof(*conn), GFP_KERNEL, w->node) : NULL;
+		if (!conn) {
+			kclose(client);
+			continue;
+		}
+		KSOCKET_STAT_INC(affine_accepts);
+
+		conn->sock = client;
+		spin_lock_bh(&w->lock);
+		list_add_tail(&conn->node, &w->queue);
+		spin_unlock_bh(&w->lock);
+		wake_up(&w->wq);
+	}
+	complete(&srv->accept_done);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static void kserver_free(struct kserver *srv) {
+	struct kserver_worker *w;
+	unsigned int cpu;
+
+	for (cpu = 0; srv->workers && cpu < nr_cpu_ids; cpu++) {
+		w = srv->workers[cpu];
+		if (!w)
+			continue;
+		if (w->task)
+			kthread_stop(w->task);
+		kfree(w);
+	}
+	kfree(srv->workers);
+	kput(srv->listener);
+	kfree(srv);
+}
+
+struct kserver *kserver_start(ksocket_t listener, const struct cpumask *cpus,
+			      kserver_handler_t handler, void *ctx, size_t buf_len) {
+	struct kserver_worker *w;
+	struct kserver *srv;
+	int cpu;
+
+	if (!listener || !handler || !buf_len)
+		return NULL;
+	if (!cpus)
+		cpus = cpu_online_mask;
+
+	srv = kzalloc(sizeof(*srv), GFP_KERNEL);
+	if (!srv)
+		return NULL;
+	srv->workers = kcalloc(nr_cpu_ids, sizeof(*srv->workers), GFP_KERNEL);
+	srv->listener = khold(listener);
+	if (!srv->workers || !srv->listener)
+		goto fail;
+	srv->handler = handler;
+	srv->ctx = ctx;
+	srv->buf_len = buf_len;
+	init_completion(&srv->accept_done);
+
+	for_each_cpu_and(cpu, cpus, cpu_online_mask) {
+		w = kzalloc_node(sizeof(*w), GFP_KERNEL, cpu_to_node(cpu));
+		if (!w)
+			goto fail;
+		w->srv = srv;
+		w->node = cpu_to_node(cpu);
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->queue);
+		init_waitqueue_head(&w->wq);
+		srv->workers[cpu] = w;
+
+		w->task = kthread_create_on_cpu(kserver_worker_fn, w, cpu, "kserver/%u");
+		if (IS_ERR(w->task)) {
+			w->task = NULL;
+			goto fail;
+		}
+		wake_up_process(w->task);
+	}
+
+	srv->acceptor = kthread_run(kserver_acceptor_fn, srv, "kserver_accept");
+	if (IS_ERR(srv->acceptor))
+		goto fail;
+	return srv;
+
+fail:
+	printk(KERN_INFO "kserver: failed to start workers\n");
+	kserver_free(srv);
+	return NULL;
+}
+
+void kserver_stop(struct kserver *srv) {
+	struct kserver_worker *w;
+	ksocket_t client;
+	unsigned int cpu;
+
+	if (!srv)
+		return;
+
+	/* the listener is the caller's, so kaccept() is interrupted instead */
+	WRITE_ONCE(srv->stopping, true);
+	while (!wait_for_completion_timeout(&srv->accept_done, msecs_to_jiffies(100)))
+		send_sig(SIGKILL, srv->acceptor, 1);
+	kthread_stop(srv->acceptor);
+
+	/* handlers blocked on a client would keep their worker from stopping */
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		w = srv->workers[cpu];
+		if (!w)
+			continue;
+		spin_lock_bh(&w->lock);
+		client = w->active ? khold(w->active->sock) : NULL;
+		spin_unlock_bh(&w->lock);
+		if (client) {
+			kshutdown(client, SHUT_RDWR);
+			kput(client);
+		}
+	}
+	kserver_free(srv);
+}
+
+//tcp fast open
+int klisten_fastopen(ksocket_t socket, int backlog, int qlen) {
+	int ret;
+
+	ret = ksetsockopt(socket, SOL_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+	if (ret < 0)
+		return ret;
+
+	return klisten(socket, backlog);
+}
+
+ssize_t kconnect_send(ksocket_t socket, struct sockaddr *address, int address_len,
+		      const void *buffer, size_t length, int flags) {
+	struct socket *sk;
+	struct msghdr msg = { 0 };
+	struct kvec iov;
+	struct kbucket *b;
+	u64 cost;
+	int ret;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	if (sk->sk->sk_protocol != IPPROTO_TCP)
+		goto fallback;
+
+	b = kbucket_charge(socket, length, flags, &cost, &ret);
+	if (ret < 0) {
+		ksocket_put(socket);
+		return ret;
+	}
+
+	iov.iov_base = (void *)buffer;
+	iov.iov_len = length;
+
+	/* connect and queue the payload behind the SYN in one call */
+	msg.msg_name = address;
+	msg.msg_namelen = address_len;
+	msg.msg_flags = flags | MSG_FASTOPEN;
+
+	ret = kernel_sendmsg(sk, &msg, &iov, 1, length);
+	kbucket_settle(b, cost, length, ret);	/* ksend() charges the fallback */
+	if (ret == -EOPNOTSUPP) {
+		/* client TFO disabled by net.ipv4.tcp_fastopen */
+		KSOCKET_STAT_INC(tfo_connect_misses);
+		goto fallback;
+	}
+
+	/* a blocking call returns with the handshake done, so we know */
+	if (ret >= 0 && !(flags & MSG_DONTWAIT)) {
+		if (tcp_sk(sk->sk)->syn_data_acked)
+			KSOCKET_STAT_INC(tfo_connect_hits);
+		else
+			KSOCKET_STAT_INC(tfo_connect_misses);
+	}
+	ksocket_put(socket);
+	return ret;
+
+fallback:
+	ksocket_put(socket);
+	ret = kconnect(socket, address, address_len);
+	if (ret < 0)
+		return ret;
+	return ksend(socket, buffer, length, flags);
+}
+
+//deferred accept
+int klisten_defer(ksocket_t socket, int backlog, int secs) {
+	int ret;
+
+	/* accept() only sees connections whose first data has arrived */
+	ret = ksetsockopt(socket, SOL_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs));
+	if (ret < 0)
+		return ret;
+
+	return klisten(socket, backlog);
+}
+
+ksocket_t kaccept_data(ksocket_t socket, struct sockaddr *address, int *address_len,
+		       void *buffer, size_t length, ssize_t *received) {
+	ksocket_t new_sk;
+	ssize_t n;
+
+	new_sk = kaccept(socket, address, address_len);
+	if (!new_sk)
+		return NULL;
+
+	/* never block here, a silent peer must not hold the acceptor */
+	n = krecv(new_sk, buffer, length, MSG_DONTWAIT);
+	if (n > 0)
+		KSOCKET_STAT_INC(accept_data_ready);
+	else if (n == -EAGAIN)
+		KSOCKET_STAT_INC(accept_data_empty);
+
+	if (received)
+		*received = n;
+	return new_sk;
+}
+
+//udp multicast and fan-out
+/* payloads at least this big are put in pages once and spliced per datagram */
+#define KFANOUT_SPLICE_MIN	1024
+
+static int ksockaddr_len(int family) {
+	if (family == AF_INET)
+		return sizeof(struct sockaddr_in);
+	if (family == AF_INET6)
+		return sizeof(struct sockaddr_in6);
+	return 0;
+}
+
+static int kmcast_level(ksocket_t socket) {
+	struct socket *sk;
+	int level;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+	level = sk->sk->sk_family == AF_INET6 ? SOL_IPV6 : SOL_IP;
+	ksocket_put(socket);
+	return level;
+}
+
+/* the protocol independent MCAST_* options cover both families */
+static int kmcast_membership(ksocket_t socket, const struct sockaddr *group,
+			     const struct sockaddr *source, int ifindex, bool join) {
+	struct group_source_req gsr;
+	struct group_req gr;
+	int level, glen, slen;
+
+	level = kmcast_level(socket);
+	if (level < 0)
+		return level;
+
+	glen = ksockaddr_len(group->sa_family);
+	if (!glen)
+		return -EAFNOSUPPORT;
+
+	if (!source) {
+		memset(&gr, 0, sizeof(gr));
+		gr.gr_interface = ifindex;
+		memcpy(&gr.gr_group, group, glen);
+		return ksetsockopt(socket, level, join ? MCAST_JOIN_GROUP : MCAST_LEAVE_GROUP,
+				   &gr, sizeof(gr));
+	}
+
+	slen = ksockaddr_len(source->sa_family);
+	if (source->sa_family != group->sa_family)
+		return -EINVAL;
+
+	memset(&gsr, 0, sizeof(gsr));
+	gsr.gsr_interface = ifindex;
+	memcpy(&gsr.gsr_group, group, glen);
+	memcpy(&gsr.gsr_source, source, slen);
+	return ksetsockopt(socket, level, join ? MCAST_JOIN_SOURCE_GROUP : MCAST_LEAVE_SOURCE_GROUP,
+			   &gsr, sizeof(gsr));
+}
+
+int kmcast_join(ksocket_t socket, const struct sockaddr *group, const struct sockaddr *source, int ifindex) {
+	return kmcast_membership(socket, group, source, ifindex, true);
+}
+
+int kmcast_leave(ksocket_t socket, const struct sockaddr *group, const struct sockaddr *source, int ifindex) {
+	return kmcast_membership(socket, group, source, ifindex, false);
+}
+
+int kmcast_set(ksocket_t socket, int ifindex, int hops, int loop) {
+	int level, ret = 0;
+
+	level = kmcast_level(socket);
+	if (level < 0)
+		return level;
+
+	if (level == SOL_IPV6) {
+		if (ifindex >= 0)
+			ret = ksetsockopt(socket, level, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex));
+		if (ret == 0 && hops >= 0)
+			ret = ksetsockopt(socket, level, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+		if (ret == 0 && loop >= 0)
+			ret = ksetsockopt(socket, level, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+		return ret;
+	}
+
+	if (ifindex >= 0) {
+		struct ip_mreqn mreq = { .imr_ifindex = ifindex };
+
+		ret = ksetsockopt(socket, level, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+	}
+	if (ret == 0 && hops >= 0)
+		ret = ksetsockopt(socket, level, IP_MULTICAST_TTL, &hops, sizeof(hops));
+	if (ret == 0 && loop >= 0)
+		ret = ksetsockopt(socket, level, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	return ret;
+}
+
+ssize_t ksendto_fanout(ksocket_t socket, const void *message, size_t length, int flags,
+		       const struct sockaddr_storage *dests, unsigned int count) {
+	struct socket *sk;
+	struct msghdr msg = {0};
+	struct kvec iov;
+	struct kbucket *b;
+	unsigned int i, sent = 0;
+	u64 cost;
+	int ret = 0;
+#ifdef MSG_SPLICE_PAGES
+	struct bio_vec *bvec = NULL;
+	unsigned int nr_pages = 0, p;
+#endif
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	if (socket->local || sk->type != SOCK_DGRAM) {
+		ksocket_put(socket);
+		return -EOPNOTSUPP;
+	}
+
+#ifdef MSG_SPLICE_PAGES
+	/*
+	 * Copy the payload once; every datagram then takes page references
+	 * instead of copying it again (the stack falls back to copying when
+	 * the route's device can't do scatter-gather).
+	 */
+	if (length >= KFANOUT_SPLICE_MIN && count > 1) {
+		nr_pages = DIV_ROUND_UP(length, PAGE_SIZE);
+		bvec = kcalloc(nr_pages, sizeof(*bvec), GFP_KERNEL);
+		if (!bvec) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		for (p = 0; p < nr_pages; p++) {
+			size_t off = (size_t)p * PAGE_SIZE;
+			size_t n = min_t(size_t, length - off, PAGE_SIZE);
+			struct page *page = alloc_page(GFP_KERNEL);
+
+			if (!page) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			memcpy(page_address(page), (const char *)message + off, n);
+			bvec_set_page(&bvec[p], page, n, 0);
+		}
+	}
+#endif
+
+	for (i = 0; i < count; i++) {
+		msg.msg_name = (void *)&dests[i];
+		msg.msg_namelen = ksockaddr_len(dests[i].ss_family);
+		if (!msg.msg_namelen) {
+			ret = -EAFNOSUPPORT;
+			break;
+		}
+		msg.msg_flags = flags;
+
+		/* per datagram, so a limit that runs dry mid-way stops there */
+		b = kbucket_charge(socket, length, flags, &cost, &ret);
+		if (ret < 0)
+			break;
+
+#ifdef MSG_SPLICE_PAGES
+		if (bvec) {
+			msg.msg_flags |= MSG_SPLICE_PAGES;
+			iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, bvec, nr_pages, length);
+			ret = sock_sendmsg(sk, &msg);
+		} else
+#endif
+		{
+			iov.iov_base = (void *)message;
+			iov.iov_len = length;
+			ret = kernel_sendmsg(sk, &msg, &iov, 1, length);
+		}
+		kbucket_settle(b, cost, length, ret);
+		if (ret < 0)
+			break;
+		sent++;
+	}
+	KSOCKET_STAT_ADD(fanout_datagrams, sent);
+
+#ifdef MSG_SPLICE_PAGES
+out:
+	if (bvec) {
+		for (p = 0; p < nr_pages; p++)
+			if (bvec[p].bv_page)
+				put_page(bvec[p].bv_page);
+		kfree(bvec);
+	}
+#endif
+	ksocket_put(socket);
+	if (sent)
+		return sent;
+	return ret;
+}
+
+//reuseport listener groups
+/*
+ * The kernel keeps a reuseport group's listeners in join order and a
+ * steering program's return value indexes that array. Members are only
+ * ever added at the end and removed from the end, so g->socks[i] stays
+ * the program's index i across grow and shrink.
+ */
+struct kreuse {
+	struct mutex lock;
+	int type, protocol;
+	struct sockaddr_storage addr;
+	int addr_len;
+	int backlog;
+	ksocket_t *socks;
+	unsigned int count, size;
+};
+
+static ksocket_t kreuse_listener(struct kreuse *g, int *err) {
+	struct socket *sk;
+	ksocket_t sock;
+	int on = 1;
+	int ret;
+
+	ret = sock_create(g->addr.ss_family, g->type, g->protocol, &sk);
+	if (ret < 0) {
+		*err = ret;
+		return NULL;
+	}
+	sock = ksocket_wrap(sk);
+	if (!sock) {
+		sock_release(sk);
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	ret = ksetsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if (ret == 0)
+		ret = kbind(sock, (struct sockaddr *)&g->addr, g->addr_len);
+	if (ret == 0 && g->type == SOCK_STREAM)
+		ret = klisten(sock, g->backlog);
+	if (ret < 0) {
+		kclose(sock);
+		*err = ret;
+		return NULL;
+	}
+	return sock;
+}
+
+/* all or nothing: a failure closes what this call already added */
+int kreuse_grow(struct kreuse *g, unsigned int n) {
+	ksocket_t *socks, sock;
+	unsigned int start;
+	int ret = 0;
+
+	mutex_lock(&g->lock);
+	if (g->count + n > g->size) {
+		socks = krealloc(g->socks, (g->count + n) * sizeof(*socks), GFP_KERNEL);
+		if (!socks) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		g->socks = socks;
+		g->size = g->count + n;
+	}
+
+	start = g->count;
+	while (n--) {
+		sock = kreuse_listener(g, &ret);
+		if (!sock)
+			break;
+		/* a port of 0 is resolved by the first bind, the rest must share it */
+		if (!g->count) {
+			ret = kgetsockname(sock, (struct sockaddr *)&g->addr, NULL);
+			if (ret < 0) {
+				kclose(sock);
+				break;
+			}
+		}
+		/* the group's steering program applies to the newcomer as well */
+		g->socks[g->count++] = sock;
+	}
+	if (ret < 0) {
+		while (g->count > start) {
+			sock = g->socks[--g->count];
+			g->socks[g->count] = NULL;
+			kclose(sock);
+		}
+	}
+out:
+	if (ret == 0)
+		ret = g->count;
+	mutex_unlock(&g->lock);
+	return ret;
+}
+
+/*
+ * Take the listener out of the lookup first, so no new SYN picks it,
+ * then hand over whatever already completed the handshake without
+ * blocking. It stays in TCP_LISTEN, so handshakes it had already
+ * started still land on its queue until the close.
+ */
+static void kreuse_drain(ksocket_t sock, kreuse_drain_fn_t drain, void *ctx) {
+	struct socket *sk, *new_sk;
+	ksocket_t client;
+
+	sk = ksocket_get(sock);
+	if (!sk)
+		return;
+
+	lock_sock(sk->sk);
+	sk->sk->sk_prot->unhash(sk->sk);
+	release_sock(sk->sk);
+
+	while (kernel_accept(sk, &new_sk, O_NONBLOCK) == 0) {
+		client = ksocket_wrap(new_sk);
+		if (!client) {
+			sock_release(new_sk);
+			continue;
+		}
+		KSOCKET_STAT_INC(reuseport_drained);
+		if (drain)
+			drain(ctx, client);
+		else
+			kclose(client);
+	}
+	ksocket_put(sock);
+}
+
+int kreuse_shrink(struct kreuse *g, unsigned int n, kreuse_drain_fn_t drain, void *ctx) {
+	ksocket_t sock;
+	int ret;
+
+	mutex_lock(&g->lock);
+	if (n >= g->count) {
+		mutex_unlock(&g->lock);
+		return -EINVAL;
+	}
+
+	while (n--) {
+		sock = g->socks[--g->count];
+		g->socks[g->count] = NULL;
+		if (g->type == SOCK_STREAM)
+			kreuse_drain(sock, drain, ctx);
+		kclose(sock);
+	}
+	ret = g->count;
+	mutex_unlock(&g->lock);
+	return ret;
+}
+
+struct kreuse *kreuse_create(int type, int protocol, struct sockaddr *address, int address_len,
+			     int backlog, unsigned int n) {
+	struct kreuse *g;
+	int ret;
+
+	if (!n || address_len <= 0 || address_len > (int)sizeof(g->addr))
+		return NULL;
+
+	g = kzalloc(sizeof(*g), GFP_KERNEL);
+	if (!g)
+		return NULL;
+
+	mutex_init(&g->lock);
+	g->type = type;
+	g->protocol = protocol;
+	memcpy(&g->addr, address, address_len);
+	g->addr_len = address_len;
+	g->backlog = backlog;
+
+	ret = kreuse_grow(g, n);
+	if (ret < 0) {
+		kreuse_destroy(g);
+		return NULL;
+	}
+	return g;
+}
+
+void kreuse_destroy(struct kreuse *g) {
+	unsigned int i;
+
+	if (!g)
+		return;
+
+	for (i = 0; i < g->count; i++)
+		kclose(g->socks[i]);
+	kfree(g->socks);
+	kfree(g);
+}
+
+unsigned int kreuse_count(struct kreuse *g) {
+	return READ_ONCE(g->count);
+}
+
+ksocket_t kreuse_get(struct kreuse *g, unsigned int index) {
+	ksocket_t sock = NULL;
+
+	mutex_lock(&g->lock);
+	if (index < g->count)
+		sock = khold(g->socks[index]);
+	mutex_unlock(&g->lock);
+	return sock;
+}
+
+/* the program lives in the kernel's group, so any member can carry it */
+static int kreuse_setsockopt(struct kreuse *g, int optname, void *optval, int optlen) {
+	int ret;
+
+	mutex_lock(&g->lock);
+	ret = ksetsockopt(g->socks[0], SOL_SOCKET, optname, optval, optlen);
+	mutex_unlock(&g->lock);
+	return ret;
+}
+
+/* on success the group owns prog and frees it once replaced */
+static int kreuse_attach(struct kreuse *g, struct bpf_prog *prog) {
+	struct socket *sk;
+	int ret;
+
+	mutex_lock(&g->lock);
+	sk = ksocket_get(g->socks[0]);
+	if (!sk) {
+		ret = -EBADF;
+		goto out;
+	}
+	lock_sock(sk->sk);
+	ret = reuseport_attach_prog(sk->sk, prog);
+	release_sock(sk->sk);
+	ksocket_put(g->socks[0]);
+out:
+	mutex_unlock(&g->lock);
+	return ret;
+}
+
+int kreuse_attach_cbpf(struct kreuse *g, struct sock_fprog_kern *fprog) {
+	struct bpf_prog *prog;
+	int ret;
+
+	ret = bpf_prog_create(&prog, fprog);
+	if (ret < 0)
+		return ret;
+	ret = kreuse_attach(g, prog);
+	if (ret < 0)
+		bpf_prog_destroy(prog);
+	return ret;
+}
+
+int kreuse_attach_ebpf(struct kreuse *g, struct bpf_prog *prog) {
+	if (prog->type != BPF_PROG_TYPE_SK_REUSEPORT &&
+	    prog->type != BPF_PROG_TYPE_SOCKET_FILTER)
+		return -EINVAL;
+	return kreuse_attach(g, prog);
+}
+
+/* index = the cpu the SYN is processed on, the hash when out of range */
+int kreuse_steer_cpu(struct kreuse *g) {
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog_kern fprog = {
+		.len = ARRAY_SIZE(code),
+		.filter = code,
+	};
+
+	return kreuse_attach_cbpf(g, &fprog);
+}
+
+int kreuse_detach(struct kreuse *g) {
+	int unused = 0;
+
+	return kreuse_setsockopt(g, SO_DETACH_REUSEPORT_BPF, &unused, sizeof(unused));
+}
+
+//idle timeout and keepalive manager
+#define KIDLE_WHEEL_BITS	9
+#define KIDLE_WHEEL_SIZE	(1 << KIDLE_WHEEL_BITS)
+#define KIDLE_WHEEL_MASK	(KIDLE_WHEEL_SIZE - 1)
+
+/*
+ * Hashed timing wheel: an entry sits in the slot of its next due time
+ * plus a count of whole revolutions still to wait. A tick only walks one
+ * slot, and activity never touches the wheel: entries are re-filed
+ * lazily when their old due time comes round.
+ */
+struct kidle {
+	struct mutex lock;	/* wheel, cur, slot; held across callbacks */
+	struct delayed_work work;
+	unsigned long tick;	/* jiffies per slot */
+	unsigned long cur;	/* due time of the slot processed next */
+	unsigned int slot;
+	bool stopping;
+	struct hlist_head off;	/* expired or out of timers, until kidle_del() */
+	struct hlist_head wheel[KIDLE_WHEEL_SIZE];
+};
+
+/*
+ * The owner holds one reference from kidle_add() to kidle_del(), and the
+ * reaper one while it shuts an expired entry's socket down. The entry is
+ * always on the wheel or on mgr->off until kidle_del() takes it off.
+ */
+struct kidle_entry {
+	struct hlist_node node;
+	struct list_head reap;
+	refcount_t ref;
+	ksocket_t sock;		/* our own reference */
+	unsigned long last;	/* registration or kidle_touch() */
+	unsigned long ka_fired;
+	unsigned long deadline;	/* absolute, 0 for none */
+	unsigned long idle;
+	unsigned long ka;
+	unsigned int rounds;
+	kidle_fn_t fn;
+	void *priv;
+};
+
+static inline unsigned long kidle_later(unsigned long a, unsigned long b) {
+	return time_after(a, b) ? a : b;
+}
+
+static inline unsigned long kidle_earlier(unsigned long a, unsigned long b) {
+	return time_before(a, b) ? a : b;
+}
+
+/* TCP already stamps every data segment it sends and receives */
+static unsigned long kidle_last_active(struct kidle_entry *e, unsigned long now) {
+	unsigned long last = READ_ONCE(e->last);
+	struct sock *sk = e->sock->sock->sk;
+	struct klocal_conn *local = READ_ONCE(e->sock->local);
+	u32 now32 = (u32)now;
+
+	/* same-host connections carry a dummy socket, the pipes see the traffic */
+	if (local) {
+		last = kidle_later(last, READ_ONCE(local->pipe[0].active));
+		last = kidle_later(last, READ_ONCE(local->pipe[1].active));
+	} else if (sk->sk_protocol == IPPROTO_TCP) {
+		last = kidle_later(last, now - (u32)(now32 - READ_ONCE(inet_csk(sk)->icsk_ack.lrcvtime)));
+		last = kidle_later(last, now - (u32)(now32 - READ_ONCE(tcp_sk(sk)->lsndtime)));
+	}
+	return last;
+}
+
+static unsigned long kidle_due(struct kidle_entry *e, unsigned long last) {
+	unsigned long due = 0;
+	bool set = false;
+
+	if (e->deadline) {
+		due = e->deadline;
+		set = true;
+	}
+	if (e->idle) {
+		due = set ? kidle_earlier(due, last + e->idle) : last + e->idle;
+		set = true;
+	}
+	if (e->ka) {
+		unsigned long ka = kidle_later(last, e->ka_fired) + e->ka;
+
+		due = set ? kidle_earlier(due, ka) : ka;
+	}
+	return due;
+}
+
+static void kidle_insert(struct kidle *mgr, struct kidle_entry *e, unsigned long due) {
+	unsigned long ticks = 0;
+
+	/* slot mgr->slot is the one processed at mgr->cur */
+	if (time_after(due, mgr->cur))
+		ticks = DIV_ROUND_UP(due - mgr->cur, mgr->tick);
+
+	e->rounds = ticks >> KIDLE_WHEEL_BITS;
+	hlist_add_head(&e->node, &mgr->wheel[(mgr->slot + ticks) & KIDLE_WHEEL_MASK]);
+}
+
+static void kidle_put(struct kidle_entry *e) {
+	if (refcount_dec_and_test(&e->ref)) {
+		kput(e->sock);
+		kfree(e);
+	}
+}
+
+static int kidle_event(struct kidle_entry *e, unsigned long now, unsigned long last) {
+	struct sock *sk = e->sock->sock->sk;
+	int state = READ_ONCE(sk->sk_state);
+
+	if (READ_ONCE(e->sock->local)) {
+		/* peer closed or shut down its sending side */
+		if (READ_ONCE(klocal_rx(e->sock)->closed))
+			return KIDLE_DEAD;
+	} else if (READ_ONCE(sk->sk_err) ||
+		   (sk->sk_protocol == IPPROTO_TCP && (state == TCP_CLOSE || state == TCP_CLOSE_WAIT))) {
+		return KIDLE_DEAD;
+	}
+	if (e->deadline && time_after_eq(now, e->deadline))
+		return KIDLE_DEADLINE;
+	if (e->idle && time_after_eq(now, last + e->idle))
+		return KIDLE_IDLE;
+	if (e->ka && time_after_eq(now, kidle_later(last, e->ka_fired) + e->ka))
+		return KIDLE_KEEPALIVE;
+	return 0;
+}
+
+/* Returns false when the entry should be closed */
+static bool kidle_check(struct kidle *mgr, struct kidle_entry *e) {
+	unsigned long now = jiffies;
+	unsigned long last = kidle_last_active(e, now);
+	int event;
+
+	event = kidle_event(e, now, last);
+	if (event) {
+		KSOCKET_STAT_INC(idle_events);
+		if (!e->fn(e->sock, event, e->priv))
+			return false;
+
+		switch (event) {
+		case KIDLE_DEADLINE:
+			/* fires once; with no other timer there is nothing to scan for */
+			e->deadline = 0;
+			if (!e->idle && !e->ka) {
+				hlist_add_head(&e->node, &mgr->off);
+				return true;
+			}
+			break;
+		case KIDLE_KEEPALIVE:
+			e->ka_fired = now;
+			break;
+		default:
+			WRITE_ONCE(e->last, now);
+			break;
+		}
+		last = kidle_last_active(e, now);
+	}
+
+	kidle_insert(mgr, e, kidle_due(e, last));
+	return true;
+}
+
+static void kidle_work(struct work_struct *work) {
+	struct kidle *mgr = container_of(to_delayed_work(work), struct kidle, work);
+	struct kidle_entry *e, *tmp;
+	struct hlist_head due;
+	struct hlist_node *n;
+	unsigned int slot;
+	LIST_HEAD(reap);
+
+	mutex_lock(&mgr->lock);
+	while (!time_before(jiffies, mgr->cur)) {
+		slot = mgr->slot;
+		hlist_move_list(&mgr->wheel[slot], &due);
+		mgr->cur += mgr->tick;
+		mgr->slot = (slot + 1) & KIDLE_WHEEL_MASK;
+
+		hlist_for_each_entry_safe(e, n, &due, node) {
+			hlist_del_init(&e->node);
+			if (e->rounds) {
+				e->rounds--;
+				hlist_add_head(&e->node, &mgr->wheel[slot]);
+			} else if (!kidle_check(mgr, e)) {
+				hlist_add_head(&e->node, &mgr->off);
+				refcount_inc(&e->ref);
+				list_add_tail(&e->reap, &reap);
+			}
+		}
+	}
+	mutex_unlock(&mgr->lock);
+
+	/*
+	 * Expired connections are shut down as one batch, outside the lock.
+	 * The handle and the entry are the owner's: kclose() and kidle_del()
+	 * are left to them, we only drop the reaper's reference.
+	 */
+	list_for_each_entry_safe(e, tmp, &reap, reap) {
+		KSOCKET_STAT_INC(idle_closes);
+		kshutdown(e->sock, SHUT_RDWR);
+		kidle_put(e);
+	}
+
+	if (!READ_ONCE(mgr->stopping))
+		queue_delayed_work(system_long_wq, &mgr->work,
+				   time_after(mgr->cur, jiffies) ? mgr->cur - jiffies : 0);
+}
+
+struct kidle *kidle_create(unsigned int tick_ms) {
+	struct kidle *mgr;
+	int i;
+
+	mgr = kzalloc(sizeof(*mgr), GFP_KERNEL);
+	if (!mgr)
+		return NULL;
+
+	mutex_init(&mgr->lock);
+	INIT_DELAYED_WORK(&mgr->work, kidle_work);
+	INIT_HLIST_HEAD(&mgr->off);
+	for (i = 0; i < KIDLE_WHEEL_SIZE; i++)
+		INIT_HLIST_HEAD(&mgr->wheel[i]);
+
+	mgr->tick = max(1UL, msecs_to_jiffies(tick_ms));
+	mgr->cur = jiffies + mgr->tick;
+	queue_delayed_work(system_long_wq, &mgr->work, mgr->tick);
+	return mgr;
+}
+
+void kidle_destroy(struct kidle *mgr) {
+	struct kidle_entry *e;
+	struct hlist_node *n;
+	int i;
+
+	if (!mgr)
+		return;
+
+	WRITE_ONCE(mgr->stopping, true);
+	cancel_delayed_work_sync(&mgr->work);
+
+	/* sockets stay open, they belong to the caller again */
+	for (i = 0; i < KIDLE_WHEEL_SIZE; i++) {
+		hlist_for_each_entry_safe(e, n, &mgr->wheel[i], node) {
+			hlist_del(&e->node);
+			kidle_put(e);
+		}
+	}
+	hlist_for_each_entry_safe(e, n, &mgr->off, node) {
+		hlist_del(&e->node);
+		kidle_put(e);
+	}
+	kfree(mgr);
+}
+
+struct kidle_entry *kidle_add(struct kidle *mgr, ksocket_t socket,
+			      unsigned int idle_ms, unsigned int keepalive_ms,
+			      unsigned int deadline_ms, kidle_fn_t fn, void *priv) {
+	struct kidle_entry *e;
+	unsigned long now = jiffies;
+
+	if (!mgr || !socket || !fn || (!idle_ms && !keepalive_ms && !deadline_ms))
+		return NULL;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return NULL;
+
+	e->sock = khold(socket);
+	if (!e->sock) {
+		kfree(e);
+		return NULL;
+	}
+	refcount_set(&e->ref, 1);
+	e->fn = fn;
+	e->priv = priv;
+	e->last = now;
+	e->ka_fired = now;
+	e->idle = idle_ms ? max(1UL, msecs_to_jiffies(idle_ms)) : 0;
+	e->ka = keepalive_ms ? max(1UL, msecs_to_jiffies(keepalive_ms)) : 0;
+	if (deadline_ms) {
+		/* 0 means no deadline */
+		e->deadline = now + msecs_to_jiffies(deadline_ms);
+		if (!e->deadline)
+			e->deadline = 1;
+	}
+
+	mutex_lock(&mgr->lock);
+	kidle_insert(mgr, e, kidle_due(e, now));
+	mutex_unlock(&mgr->lock);
+	return e;
+}
+
+void kidle_del(struct kidle *mgr, struct kidle_entry *e) {
+	if (!mgr || !e)
+		return;
+
+	mutex_lock(&mgr->lock);
+	if (!hlist_unhashed(&e->node))
+		hlist_del_init(&e->node);
+	mutex_unlock(&mgr->lock);
+	kidle_put(e);
+}
+
+void kidle_touch(struct kidle_entry *e) {
+	WRITE_ONCE(e->last, jiffies);
+}
+
+int kset_keepalive(ksocket_t socket, int idle, int interval, int count) {
+	int on = idle > 0;
+	int ret;
+
+	ret = ksetsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	if (ret < 0 || !on)
+		return ret;
+
+	ret = ksetsockopt(socket, SOL_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	if (ret == 0 && interval > 0)
+		ret = ksetsockopt(socket, SOL_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+	if (ret == 0 && count > 0)
+		ret = ksetsockopt(socket, SOL_TCP, TCP_KEEPCNT, &count, sizeof(count));
+	return ret;
+}
+
+//tcp_info and congestion control
+int kget_tcp_info(ksocket_t socket, struct tcp_info *info) {
+	int len = sizeof(*info);
+
+	return kgetsockopt(socket, SOL_TCP, TCP_INFO, info, &len);
+}
+
+int kset_congestion(ksocket_t socket, const char *name) {
+	return ksetsockopt(socket, SOL_TCP, TCP_CONGESTION, (void *)name, strlen(name));
+}
+
+int kget_congestion(ksocket_t socket, char *name, int length) {
+	int ret;
+
+	if (length <= 0)
+		return -EINVAL;
+
+	ret = kgetsockopt(socket, SOL_TCP, TCP_CONGESTION, name, &length);
+	if (ret == 0)
+		name[length - 1] = '\0';
+	return ret;
+}
+
+struct ktcp_sampler {
+	struct list_head node;
+	ksocket_t sock;
+	unsigned long interval;
+	struct delayed_work work;
+	struct sockaddr_storage local, peer;
+	struct tcp_info last;	/* under ktcp_samplers_lock */
+	bool valid;
+};
+
+static LIST_HEAD(ktcp_samplers);
+static DEFINE_MUTEX(ktcp_samplers_lock);
+
+static void ktcp_sample_work(struct work_struct *work) {
+	struct ktcp_sampler *s = container_of(to_delayed_work(work), struct ktcp_sampler, work);
+	struct tcp_info info;
+	int ret;
+
+	ret = kget_tcp_info(s->sock, &info);
+	if (ret == -EBADF)
+		return;	/* closed under us, stop sampling */
+
+	if (ret == 0) {
+		mutex_lock(&ktcp_samplers_lock);
+		if (s->valid) {
+			KSOCKET_STAT_ADD(tcp_sample_retrans, info.tcpi_total_retrans - s->last.tcpi_total_retrans);
+			KSOCKET_STAT_ADD(tcp_sample_bytes_acked, info.tcpi_bytes_acked - s->last.tcpi_bytes_acked);
+		}
+		s->last = info;
+		s->valid = true;
+		mutex_unlock(&ktcp_samplers_lock);
+		KSOCKET_STAT_INC(tcp_samples);
+	}
+
+	queue_delayed_work(system_long_wq, &s->work, s->interval);
+}
+
+struct ktcp_sampler *ktcp_sample_start(ksocket_t socket, unsigned int interval_ms) {
+	struct ktcp_sampler *s;
+	int len;
+
+	if (!interval_ms)
+		return NULL;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+
+	len = sizeof(s->local);
+	kgetsockname(socket, (struct sockaddr *)&s->local, &len);
+	len = sizeof(s->peer);
+	kgetpeername(socket, (struct sockaddr *)&s->peer, &len);
+
+	s->sock = khold(socket);
+	if (!s->sock) {
+		kfree(s);
+		return NULL;
+	}
+	s->interval = max(msecs_to_jiffies(interval_ms), 1UL);
+	INIT_DELAYED_WORK(&s->work, ktcp_sample_work);
+
+	mutex_lock(&ktcp_samplers_lock);
+	list_add_tail(&s->node, &ktcp_samplers);
+	mutex_unlock(&ktcp_samplers_lock);
+
+	queue_delayed_work(system_long_wq, &s->work, 0);
+	return s;
+}
+
+int ktcp_sample_last(struct ktcp_sampler *s, struct tcp_info *info) {
+	int ret = -EAGAIN;
+
+	mutex_lock(&ktcp_samplers_lock);
+	if (s->valid) {
+		*info = s->last;
+		ret = 0;
+	}
+	mutex_unlock(&ktcp_samplers_lock);
+	return ret;
+}
+
+void ktcp_sample_stop(struct ktcp_sampler *s) {
+	if (!s)
+		return;
+
+	cancel_delayed_work_sync(&s->work);
+	mutex_lock(&ktcp_samplers_lock);
+	list_del(&s->node);
+	mutex_unlock(&ktcp_samplers_lock);
+	kput(s->sock);
+	kfree(s);
+}
+
+static void ktcp_samplers_show(struct seq_file *seq) {
+	struct ktcp_sampler *s;
+
+	mutex_lock(&ktcp_samplers_lock);
+	list_for_each_entry(s, &ktcp_samplers, node) {
+		if (!s->valid)
+			continue;
+		seq_printf(seq, "tcp %pISpc -> %pISpc rtt %u rttvar %u cwnd %u retrans %u pacing %llu delivery %llu\n",
+			   &s->local, &s->peer, s->last.tcpi_rtt, s->last.tcpi_rttvar,
+			   s->last.tcpi_snd_cwnd, s->last.tcpi_total_retrans,
+			   s->last.tcpi_pacing_rate, s->last.tcpi_delivery_rate);
+	}
+	mutex_unlock(&ktcp_samplers_lock);
+}
+
+//send-side flow control
+int kget_sendq(ksocket_t socket, int *queued, int *unsent) {
+	struct socket *sk;
+	struct sock *s;
+	int q, u;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+	s = sk->sk;
+
+	if (socket->local) {
+		q = u = READ_ONCE(klocal_tx(socket)->queued);
+	} else if (s->sk_protocol == IPPROTO_TCP) {
+		/* as SIOCOUTQ and SIOCOUTQNSD */
+		int state = inet_sk_state_load(s);
+
+		if (state == TCP_LISTEN) {
+			ksocket_put(socket);
+			return -EINVAL;
+		}
+		if ((1 << state) & (TCPF_SYN_SENT | TCPF_SYN_RECV)) {
+			q = u = 0;
+		} else {
+			q = READ_ONCE(tcp_sk(s)->write_seq) - tcp_sk(s)->snd_una;
+			u = READ_ONCE(tcp_sk(s)->write_seq) - READ_ONCE(tcp_sk(s)->snd_nxt);
+		}
+	} else {
+		q = u = sk_wmem_alloc_get(s);
+	}
+	ksocket_put(socket);
+
+	if (queued)
+		*queued = q;
+	if (unsent)
+		*unsent = u;
+	return 0;
+}
+
+int kset_send_watermarks(ksocket_t socket, int low, int high) {
+	int ret = 0;
+
+	if (low > 0)
+		ret = ksetsockopt(socket, SOL_TCP, TCP_NOTSENT_LOWAT, &low, sizeof(low));
+	if (ret == 0 && high > 0) {
+		/* the stack doubles SO_SNDBUF for its own overhead */
+		high /= 2;
+		ret = ksetsockopt(socket, SOL_SOCKET, SO_SNDBUF, &high, sizeof(high));
+	}
+	return ret;
+}
+
+struct kflow {
+	ksocket_t sock;
+	kwritable_fn_t fn;
+	void *ctx;
+	void (*write_space)(struct sock *sk);
+	struct work_struct work;
+	struct sock *sk;	/* held while parked across sock_release() */
+};
+
+/* each queued run holds a handle reference, dropped as its last action */
+static void kflow_work(struct work_struct *work) {
+	struct kflow *f = container_of(work, struct kflow, work);
+	ksocket_t sock = f->sock;
+	kwritable_fn_t fn = READ_ONCE(f->fn);
+
+	if (fn) {
+		KSOCKET_STAT_INC(writable_events);
+		fn(sock, f->ctx);
+	}
+	kput(sock);
+}
+
+/* softirq: chain to the stack's handler, then defer ours to process context */
+static void kflow_write_space(struct sock *sk) {
+	struct kflow *f;
+	bool writable;
+
+	rcu_read_lock();
+	f = rcu_dereference_sk_user_data(sk);
+	if (!f) {
+		rcu_read_unlock();
+		return;
+	}
+
+	f->write_space(sk);
+	if (!READ_ONCE(f->fn)) {	/* parked: pass-through only */
+		rcu_read_unlock();
+		return;
+	}
+	if (sk->sk_type == SOCK_STREAM)
+		writable = sk_stream_is_writeable(sk);
+	else
+		writable = sock_writeable(sk);
+
+	if (writable && khold(f->sock) && !queue_work(system_wq, &f->work))
+		kput(f->sock);	/* already queued, and that run holds its own */
+	rcu_read_unlock();
+}
+
+/*
+ * Take our callback out of the chain, but only while it is still on top.
+ * A layer hooked after us (ktls_start() after kset_writable_cb()) saved
+ * kflow_write_space as its next hop, and restoring underneath it would
+ * drop its handler. Then the flow stays installed as a pass-through with
+ * fn cleared, and false is returned.
+ */
+static bool kflow_unhook(struct sock *sk, struct kflow *f) {
+	bool top;
+
+	WRITE_ONCE(f->fn, NULL);
+	write_lock_bh(&sk->sk_callback_lock);
+	top = sk->sk_write_space == kflow_write_space;
+	if (top) {
+		sk->sk_write_space = f->write_space;
+		rcu_assign_sk_user_data(sk, NULL);
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+
+	synchronize_rcu();
+	return top;
+}
+
+/*
+ * Last reference gone: nothing can be queued, at most this is its run.
+ * A parked flow is returned with its sock held; the layer above unwinds
+ * in sock_release() and kflow_reap() finishes after it.
+ */
+static struct kflow *kflow_release(ksocket_t socket) {
+	struct kflow *f = socket->flow;
+	struct sock *sk = socket->sock->sk;
+
+	if (!f)
+		return NULL;
+	socket->flow = NULL;
+	if (kflow_unhook(sk, f)) {
+		kfree(f);
+		return NULL;
+	}
+	sock_hold(sk);
+	f->sk = sk;
+	return f;
+}
+
+static void kflow_reap(struct kflow *f) {
+	struct sock *sk = f->sk;
+
+	if (kflow_unhook(sk, f)) {
+		sock_put(sk);
+		kfree(f);
+		return;
+	}
+	/* still chained under a layer that outlives us: keep the pass-through */
+	sock_put(sk);
+	__module_get(THIS_MODULE);
+	printk(KERN_WARNING "ksocket: write_space still chained on close, pinning module\n");
+}
+
+int kset_writable_cb(ksocket_t socket, kwritable_fn_t fn, void *ctx) {
+	struct socket *sk;
+	struct sock *s;
+	struct kflow *f;
+	int ret = 0;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+	s = sk->sk;
+
+	if (socket->local) {
+		ksocket_put(socket);
+		return -EOPNOTSUPP;
+	}
+
+	f = socket->flow;
+	if (f) {
+		bool top = kflow_unhook(s, f);
+
+		if (cancel_work_sync(&f->work))
+			kput(socket);
+		if (!top) {
+			/* still chained below another layer: re-arm in place */
+			f->ctx = ctx;
+			WRITE_ONCE(f->fn, fn);
+			goto out;
+		}
+		socket->flow = NULL;
+		kfree(f);
+	}
+	if (!fn)
+		goto out;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	f->sock = socket;
+	f->fn = fn;
+	f->ctx = ctx;
+	INIT_WORK(&f->work, kflow_work);
+
+	/*
+	 * sk_clone_lock() copies sk_user_data and sk_write_space into every
+	 * accepted child, which would then run the listener's flow.
+	 */
+	write_lock_bh(&s->sk_callback_lock);
+	if (s->sk_state == TCP_LISTEN) {
+		ret = -EINVAL;
+	} else if (s->sk_user_data) {
+		ret = -EBUSY;
+	} else {
+		f->write_space = s->sk_write_space;
+		socket->flow = f;
+		rcu_assign_sk_user_data(s, f);
+		s->sk_write_space = kflow_write_space;
+	}
+	write_unlock_bh(&s->sk_callback_lock);
+	if (ret < 0)
+		kfree(f);
+
+out:
+	ksocket_put(socket);
+	return ret;
+}
+
+//pacing and rate limiting
+int kset_pacing_rate(ksocket_t socket, unsigned long rate) {
+	/* enforced by TCP's internal pacing or the fq qdisc */
+	return ksetsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+}
+
+/*
+ * Token bucket kept as a virtual clock: tat is when the bytes admitted
+ * so far will have drained at rate. A sender waits until tat is no more
+ * than burst_ns ahead of now, so concurrent senders queue in order.
+ */
+struct kbucket {
+	spinlock_t lock;
+	refcount_t ref;
+	u64 rate;		/* bytes per second */
+	u64 burst_ns;
+	u64 tat;
+	atomic64_t throttled_ns;
+};
+
+static DEFINE_SPINLOCK(kbucket_lock);	/* socket->bucket */
+
+struct kbucket *kbucket_create(u64 rate, u32 burst) {
+	struct kbucket *b;
+
+	if (!rate)
+		return NULL;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return NULL;
+
+	spin_lock_init(&b->lock);
+	refcount_set(&b->ref, 1);
+	b->rate = rate;
+	b->burst_ns = mul_u64_u64_div_u64(burst, NSEC_PER_SEC, rate);
+	atomic64_set(&b->throttled_ns, 0);
+	return b;
+}
+
+void kbucket_destroy(struct kbucket *b) {
+	if (b && refcount_dec_and_test(&b->ref))
+		kfree(b);
+}
+
+int kbucket_set_rate(struct kbucket *b, u64 rate, u32 burst) {
+	if (!rate)
+		return -EINVAL;
+
+	spin_lock(&b->lock);
+	b->rate = rate;
+	b->burst_ns = mul_u64_u64_div_u64(burst, NSEC_PER_SEC, rate);
+	spin_unlock(&b->lock);
+	return 0;
+}
+
+u64 kbucket_throttled_ns(struct kbucket *b) {
+	return atomic64_read(&b->throttled_ns);
+}
+
+int kset_rate_limit(ksocket_t socket, struct kbucket *b) {
+	struct kbucket *old;
+
+	if (!ksocket_get(socket))
+		return -EBADF;
+
+	if (b)
+		refcount_inc(&b->ref);
+	spin_lock(&kbucket_lock);
+	old = socket->bucket;
+	socket->bucket = b;
+	spin_unlock(&kbucket_lock);
+	kbucket_destroy(old);
+
+	ksocket_put(socket);
+	return 0;
+}
+
+/* reserve length bytes, sleeping while the bucket is over its burst */
+static bool kbucket_stopped(ksocket_t socket) {
+	return test_bit(KSOCKET_CLOSING, &socket->flags) ||
+	       test_bit(KSOCKET_SEND_SHUT, &socket->flags);
+}
+
+static struct kbucket *kbucket_charge(ksocket_t socket, size_t length, int flags, u64 *cost, int *err) {
+	struct kbucket *b;
+	ktime_t expires;
+	u64 now, wait = 0;
+	long ret;
+
+	*err = 0;
+	if (!READ_ONCE(socket->bucket))
+		return NULL;
+
+	spin_lock(&kbucket_lock);
+	b = socket->bucket;
+	if (b)
+		refcount_inc(&b->ref);
+	spin_unlock(&kbucket_lock);
+	if (!b)
+		return NULL;
+
+	spin_lock(&b->lock);
+	now = ktime_get_ns();
+	if (b->tat < now)
+		b->tat = now;
+	if (b->tat - now > b->burst_ns) {
+		wait = b->tat - now - b->burst_ns;
+		if (flags & MSG_DONTWAIT) {
+			spin_unlock(&b->lock);
+			kbucket_destroy(b);
+			*err = -EAGAIN;
+			return NULL;
+		}
+	}
+	*cost = mul_u64_u64_div_u64(length, NSEC_PER_SEC, b->rate);
+	b->tat += *cost;
+	spin_unlock(&b->lock);
+
+	if (!wait)
+		return b;
+
+	/* 0 here means the handle was closed or shut down under us */
+	expires = ns_to_ktime(wait);
+	ret = wait_event_interruptible_hrtimeout(kbucket_wq, kbucket_stopped(socket), expires);
+
+	wait = ktime_get_ns() - now;
+	atomic64_add(wait, &b->throttled_ns);
+	KSOCKET_STAT_INC(throttle_waits);
+	KSOCKET_STAT_ADD(throttle_ns, wait);
+
+	if (ret == -ETIME)
+		return b;
+	if (ret == 0)
+		*err = test_bit(KSOCKET_CLOSING, &socket->flags) ? -EBADF : -EPIPE;
+	else
+		*err = -EINTR;
+	kbucket_settle(b, *cost, length, *err);
+	return NULL;
+}
+
+/* refund the unsent (length - sent) share of cost, then drop the reference */
+static void kbucket_settle(struct kbucket *b, u64 cost, size_t length, ssize_t sent) {
+	u64 refund = cost;
+
+	if (!b)
+		return;
+
+	if (sent > 0 && (size_t)sent >= length)
+		refund = 0;
+	else if (sent > 0)
+		refund = mul_u64_u64_div_u64(cost, length - sent, length);
+	if (refund) {
+		spin_lock(&b->lock);
+		b->tat -= refund;
+		spin_unlock(&b->lock);
+	}
+	kbucket_destroy(b);
+}
+
+//kernel tls
+int ktls_start(ksocket_t socket) {
+	static char ulp[] = "tls";
+
+	/* the tls module is loaded on demand by TCP_ULP */
+	return ksetsockopt(socket, SOL_TCP, TCP_ULP, ulp, sizeof(ulp));
+}
+
+int ktls_set_key(ksocket_t socket, int direction, const void *crypto_info, int length) {
+	if (direction != TLS_TX && direction != TLS_RX)
+		return -EINVAL;
+	if (!crypto_info || length < (int)sizeof(struct tls_crypto_info))
+		return -EINVAL;
+
+	return ksetsockopt(socket, SOL_TLS, direction, (void *)crypto_info, length);
+}
+
+ssize_t ksend_tls_record(ksocket_t socket, unsigned char record_type,
+			 const void *buffer, size_t length, int flags) {
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))] = { 0 };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct socket *sk;
+	struct kvec iov;
+	struct kbucket *b;
+	u64 cost;
+	int ret;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	b = kbucket_charge(socket, length, flags, &cost, &ret);
+	if (ret < 0) {
+		ksocket_put(socket);
+		return ret;
+	}
+
+	cmsg = (struct cmsghdr *)cbuf;
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*(unsigned char *)CMSG_DATA(cmsg) = record_type;
+
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	msg.msg_flags = flags;
+
+	iov.iov_base = (void *)buffer;
+	iov.iov_len = length;
+
+	ret = kernel_sendmsg(sk, &msg, &iov, 1, length);
+	kbucket_settle(b, cost, length, ret);
+	ksocket_put(socket);
+	return ret;
+}
+
+ssize_t krecv_tls(ksocket_t socket, void *buffer, size_t length, int flags,
+		  unsigned char *record_type) {
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))] = { 0 };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct socket *sk;
+	struct kvec iov;
+	int ret;
+
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	/* without room for the cmsg, non-data records fail with -EIO */
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+
+	ret = kernel_recvmsg(sk, &msg, &iov, 1, length, flags);
+	ksocket_put(socket);
+	if (ret < 0 || !record_type)
+		return ret;
+
+	/* put_cmsg() advances msg_control past what it wrote */
+	cmsg = (struct cmsghdr *)cbuf;
+	if (sizeof(cbuf) - msg.msg_controllen >= CMSG_LEN(sizeof(unsigned char)) &&
+	    cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+		*record_type = *(unsigned char *)CMSG_DATA(cmsg);
+	else
+		*record_type = KTLS_RECORD_DATA;
+
+	return ret;
+}
+
+//length-prefixed framing and pipelined rpc
+#define KRPC_HASH_BITS	6
+#define KRPC_MAX_FRAME	(16 << 20)
+
+/* On-wire frame header, followed by len bytes of payload */
+struct krpc_hdr {
+	__be32 len;
+	__be32 id;
+	__be32 status;	/* 0 or negative errno, responses only */
+};
+
+struct krpc {
+	ksocket_t handle;	/* our own reference */
+	struct task_struct *rx_thread;
+	struct mutex tx_lock;	/* keeps frames from interleaving */
+	spinlock_t lock;	/* protects calls, next_id, dead, err */
+	DECLARE_HASHTABLE(calls, KRPC_HASH_BITS);
+	u32 next_id;
+	bool dead;
+	int err;
+};
+
+struct krpc_call {
+	struct hlist_node node;	/* hashed while the call is outstanding */
+	struct list_head fail;
+	struct timer_list timer;
+	struct krpc *rpc;
+	u32 id;
+	void *resp;
+	size_t resp_len;
+	ssize_t result;
+	krpc_done_t done;	/* NULL for synchronous calls */
+	void *ctx;
+	struct completion wait;
+};
+
+/* the caller holds a reference on socket for these */
+static int ksocket_xmit(ksocket_t socket, struct kvec *iov, size_t nr, size_t total) {
+	struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+	struct kbucket *b;
+	size_t i, done, sent = 0;
+	ssize_t n;
+	u64 cost;
+	int ret;
+
+	b = kbucket_charge(socket, total, 0, &cost, &ret);
+	if (ret < 0)
+		return ret;
+
+	if (socket->local) {
+		for (i = 0; i < nr; i++) {
+			for (done = 0; done < iov[i].iov_len; done += n) {
+				n = klocal_send(klocal_tx(socket), (char *)iov[i].iov_base + done,
+						iov[i].iov_len - done, 0);
+				if (n < 0) {
+					ret = n;
+					goto out;
+				}
+				sent += n;
+			}
+		}
+		goto out;
+	}
+
+	iov_iter_kvec(&msg.msg_iter, ITER_SOURCE, iov, nr, total);
+	while (msg_data_left(&msg)) {
+		ret = sock_sendmsg(socket->sock, &msg);
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			ret = -EPIPE;
+			break;
+		}
+	}
+	sent = total - msg_data_left(&msg);
+out:
+	kbucket_settle(b, cost, total, sent);
+	return ret < 0 ? ret : 0;
+}
+
+static int ksocket_recv_all(ksocket_t socket, void *buffer, size_t length) {
+	struct msghdr msg = { 0 };
+	struct kvec iov = { .iov_base = buffer, .iov_len = length };
+	ssize_t n;
+	size_t done;
+	int ret;
+
+	if (socket->local) {
+		for (done = 0; done < length; done += n) {
+			n = klocal_recv(klocal_rx(socket), (char *)buffer + done, length - done, 0);
+			if (n < 0)
+				return n;
+			if (n == 0)
+				return -ECONNRESET;
+		}
+		return 0;
+	}
+
+	iov_iter_kvec(&msg.msg_iter, ITER_DEST, &iov, 1, length);
+	while (msg_data_left(&msg)) {
+		ret = sock_recvmsg(socket->sock, &msg, MSG_WAITALL);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return -ECONNRESET;
+	}
+	return 0;
+}
+
+static int ksocket_discard(ksocket_t socket, size_t length) {
+	char scratch[128];
+	size_t n;
+	int ret;
+
+	while (length) {
+		n = min(length, sizeof(scratch));
+		ret = ksocket_recv_all(socket, scratch, n);
+		if (ret < 0)
+			return ret;
+		length -= n;
+	}
+	return 0;
+}
+
+static int krpc_send_frame(ksocket_t socket, u32 id, int status, const void *buffer, size_t length) {
+	struct krpc_hdr hdr;
+	struct kvec iov[2];
+
+	hdr.len = cpu_to_be32(length);
+	hdr.id = cpu_to_be32(id);
+	hdr.status = cpu_to_be32(status);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)buffer;
+	iov[1].iov_len = length;
+
+	return ksocket_xmit(socket, iov, length ? 2 : 1, sizeof(hdr) + length);
+}
+
+/* Whoever unhashes a call owns its completion */
+static struct krpc_call *krpc_claim(struct krpc *rpc, u32 id) {
+	struct krpc_call *c;
+
+	spin_lock_bh(&rpc->lock);
+	hash_for_each_possible(rpc->calls, c, node, id) {
+		if (c->id == id) {
+			hash_del(&c->node);
+			spin_unlock_bh(&rpc->lock);
+			return c;
+		}
+	}
+	spin_unlock_bh(&rpc->lock);
+	return NULL;
+}
+
+static void krpc_finish(struct krpc_call *c, ssize_t result) {
+	c->result = result;
+	if (!c->done) {
+		complete(&c->wait);
+		return;
+	}
+	c->done(c->ctx, result);
+	kfree(c);
+}
+
+static void krpc_timeout(struct timer_list *t) {
+	struct krpc_call *c = container_of(t, struct krpc_call, timer);
+	struct krpc *rpc = c->rpc;
+	bool claimed = false;
+
+	spin_lock_bh(&rpc->lock);
+	if (hash_hashed(&c->node)) {
+		hash_del(&c->node);
+		claimed = true;
+	}
+	spin_unlock_bh(&rpc->lock);
+
+	if (claimed)
+		krpc_finish(c, -ETIMEDOUT);
+}
+
+static void krpc_fail_all(struct krpc *rpc, int err) {
+	struct krpc_call *c, *tmp;
+	struct hlist_node *n;
+	LIST_HEAD(failed);
+	int bkt;
+
+	spin_lock_bh(&rpc->lock);
+	if (!rpc->dead) {
+		rpc->dead = true;
+		rpc->err = err;
+	}
+	hash_for_each_safe(rpc->calls, bkt, n, c, node) {
+		hash_del(&c->node);
+		list_add_tail(&c->fail, &failed);
+	}
+	spin_unlock_bh(&rpc->lock);
+
+	list_for_each_entry_safe(c, tmp, &failed, fail) {
+		timer_delete_sync(&c->timer);
+		krpc_finish(c, err);
+	}
+}
+
+static int krpc_rx_thread(void *data) {
+	struct krpc *rpc = data;
+	struct krpc_call *c;
+	struct krpc_hdr hdr;
+	ssize_t result;
+	u32 len;
+	int ret = 0;
+
+	while (!kthread_should_stop()) {
+		ret = ksocket_recv_all(rpc->handle, &hdr, sizeof(hdr));
+		if (ret < 0)
+			break;
+
+		len = be32_to_cpu(hdr.len);
+		if (len > KRPC_MAX_FRAME) {
+			ret = -EPROTO;
+			break;
+		}
+
+		c = krpc_claim(rpc, be32_to_cpu(hdr.id));
+		if (!c) {
+			/* timed out or unknown, drop the payload */
+			ret = ksocket_discard(rpc->handle, len);
+			if (ret < 0)
+				break;
+			continue;
+		}
+		timer_delete_sync(&c->timer);
+
+		if (len > c->resp_len) {
+			ret = ksocket_recv_all(rpc->handle, c->resp, c->resp_len);
+			if (!ret)
+				ret = ksocket_discard(rpc->handle, len - c->resp_len);
+			result = -EMSGSIZE;
+		} else {
+			ret = ksocket_recv_all(rpc->handle, c->resp, len);
+			result = len;
+		}
+		if (ret < 0) {
+			krpc_finish(c, ret);
+			break;
+		}
+		if (hdr.status)
+			result = (s32)be32_to_cpu(hdr.status);
+		krpc_finish(c, result);
+	}
+
+	krpc_fail_all(rpc, ret < 0 ? ret : -ESHUTDOWN);
+
+	/* stay around until krpc_destroy() reaps us */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+struct krpc *krpc_create(ksocket_t socket) {
+	struct krpc *rpc;
+
+	rpc = kzalloc(sizeof(*rpc), GFP_KERNEL);
+	if (!rpc)
+		return NULL;
+
+	rpc->handle = khold(socket);
+	if (!rpc->handle) {
+		kfree(rpc);
+		return NULL;
+	}
+	mutex_init(&rpc->tx_lock);
+	spin_lock_init(&rpc->lock);
+	hash_init(rpc->calls);
+
+	rpc->rx_thread = kthread_run(krpc_rx_thread, rpc, "krpc_rx");
+	if (IS_ERR(rpc->rx_thread)) {
+		printk(KERN_INFO "krpc: kthread_run failed\n");
+		kput(rpc->handle);
+		kfree(rpc);
+		return NULL;
+	}
+	return rpc;
+}
+
+void krpc_destroy(struct krpc *rpc) {
+	if (!rpc)
+		return;
+
+	/* unblock the receiver, it fails every outstanding call on its way out */
+	kshutdown(rpc->handle, SHUT_RDWR);
+	kthread_stop(rpc->rx_thread);
+	krpc_fail_all(rpc, -ESHUTDOWN);
+	kput(rpc->handle);
+	kfree(rpc);
+}
+
+static struct krpc_call *krpc_call_alloc(struct krpc *rpc, void *resp, size_t resp_len,
+					 krpc_done_t done, void *ctx) {
+	struct krpc_call *c;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return NULL;
+
+	INIT_HLIST_NODE(&c->node);
+	timer_setup(&c->timer, krpc_timeout, 0);
+	init_completion(&c->wait);
+	c->rpc = rpc;
+	c->resp = resp;
+	c->resp_len = resp_len;
+	c->done = done;
+	c->ctx = ctx;
+	return c;
+}
+
+/*
+ * Hash the call and put its request on the wire. Once hashed the call may
+ * complete (and an async one be freed) at any time, so only its id is
+ * used afterwards.
+ */
+static int krpc_submit(struct krpc *rpc, struct krpc_call *c, const void *req,
+		       size_t req_len, unsigned int timeout_ms) {
+	u32 id;
+	int ret;
+
+	if (req_len > KRPC_MAX_FRAME)
+		return -EMSGSIZE;
+
+	spin_lock_bh(&rpc->lock);
+	if (rpc->dead) {
+		ret = rpc->err;
+		spin_unlock_bh(&rpc->lock);
+		return ret;
+	}
+	id = c->id = rpc->next_id++;
+	hash_add(rpc->calls, &c->node, id);
+	if (timeout_ms)
+		mod_timer(&c->timer, jiffies + msecs_to_jiffies(timeout_ms));
+	spin_unlock_bh(&rpc->lock);
+
+	mutex_lock(&rpc->tx_lock);
+	ret = krpc_send_frame(rpc->handle, id, 0, req, req_len);
+	if (ret < 0) {
+		/*
+		 * Part of the frame may be on the wire, nothing after it
+		 * would parse: kill the stream and every call on it.
+		 */
+		kshutdown(rpc->handle, SHUT_RDWR);
+		mutex_unlock(&rpc->tx_lock);
+		krpc_fail_all(rpc, ret);
+		return 0;
+	}
+	mutex_unlock(&rpc->tx_lock);
+	return 0;
+}
+
+ssize_t krpc_call(struct krpc *rpc, const void *req, size_t req_len,
+		  void *resp, size_t resp_len, unsigned int timeout_ms) {
+	struct krpc_call *c;
+	ssize_t ret;
+
+	c = krpc_call_alloc(rpc, resp, resp_len, NULL, NULL);
+	if (!c)
+		return -ENOMEM;
+
+	ret = krpc_submit(rpc, c, req, req_len, timeout_ms);
+	if (ret < 0) {
+		kfree(c);
+		return ret;
+	}
+
+	wait_for_completion(&c->wait);
+	timer_delete_sync(&c->timer);
+	ret = c->result;
+	kfree(c);
+	return ret;
+}
+
+int krpc_call_async(struct krpc *rpc, const void *req, size_t req_len,
+		    void *resp, size_t resp_len, unsigned int timeout_ms,
+		    krpc_done_t done, void *ctx) {
+	struct krpc_call *c;
+	int ret;
+
+	if (!done)
+		return -EINVAL;
+
+	c = krpc_call_alloc(rpc, resp, resp_len, done, ctx);
+	if (!c)
+		return -ENOMEM;
+
+	ret = krpc_submit(rpc, c, req, req_len, timeout_ms);
+	if (ret < 0)
+		kfree(c);
+	return ret;
+}
+
+/* kthread_should_stop() is only valid on a kthread */
+static bool krpc_should_stop(void) {
+	return (current->flags & PF_KTHREAD) && kthread_should_stop();
+}
+
+int krpc_serve(ksocket_t socket, krpc_handler_t handler, void *ctx, size_t max_len) {
+	struct socket *sk;
+	struct krpc_hdr hdr;
+	void *req, *resp;
+	ssize_t n;
+	u32 len;
+	int ret = 0;
+
+	if (!handler || max_len > KRPC_MAX_FRAME)
+		return -EINVAL;
 
-	if (!sk || !sk->ops || !sk->ops->getsockopt) {
-		return -ENOSYS;
+	sk = ksocket_get(socket);
+	if (!sk)
+		return -EBADF;
+
+	req = kvmalloc(max_len, GFP_KERNEL);
+	resp = kvmalloc(max_len, GFP_KERNEL);
+	if (!req || !resp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (!krpc_should_stop()) {
+		ret = ksocket_recv_all(socket, &hdr, sizeof(hdr));
+		if (ret < 0)
+			break;
+
+		len = be32_to_cpu(hdr.len);
+		if (len > max_len) {
+			ret = ksocket_discard(socket, len);
+			if (ret < 0)
+				break;
+			n = -EMSGSIZE;
+		} else {
+			ret = ksocket_recv_all(socket, req, len);
+			if (ret < 0)
+				break;
+			n = handler(ctx, req, len, resp, max_len);
+		}
+
+		if (n < 0)
+			ret = krpc_send_frame(socket, be32_to_cpu(hdr.id), n, NULL, 0);
+		else
+			ret = krpc_send_frame(socket, be32_to_cpu(hdr.id), 0, resp, min_t(size_t, n, max_len));
+		if (ret < 0) {
+			/* a half-sent response desynchronises the peer */
+			kshutdown(socket, SHUT_RDWR);
+			break;
+		}
+	}
+
+	/* peer closing the connection is the normal way out */
+	if (ret == -ECONNRESET || krpc_should_stop())
+		ret = 0;
+out:
+	kvfree(req);
+	kvfree(resp);
+	ksocket_put(socket);
+	return ret;
+}
+
+//mmap'd receive ring
+#define KRING_MAX_BYTES	(1UL << 30)
+
+static unsigned int ring_pages = 16;
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "data pages per cpu ring of /dev/ksocket_ring, 0 disables");
+
+/*
+ * One ring per possible cpu, laid out back to back in a single vmalloc
+ * area that userspace maps whole: a header page, then ring_pages of data.
+ */
+struct kring {
+	struct mutex lock;	/* producers on this ring */
+	struct kring_header *hdr;
+	char *data;
+	u32 head;		/* written, published up to hdr->producer */
+};
+
+static void *kring_area;
+static struct kring *kring_rings;
+static u32 kring_size;
+static DECLARE_WAIT_QUEUE_HEAD(kring_wq);
+
+static void kring_publish(struct kring *r) {
+	if (r->head == r->hdr->producer)
+		return;
+
+	smp_store_release(&r->hdr->producer, r->head);
+	if (wq_has_sleeper(&kring_wq))
+		wake_up_interruptible(&kring_wq);
+}
+
+void kring_flush(void) {
+	unsigned int cpu;
+
+	if (!kring_rings)
+		return;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		mutex_lock(&kring_rings[cpu].lock);
+		kring_publish(&kring_rings[cpu]);
+		mutex_unlock(&kring_rings[cpu].lock);
+	}
+}
+
+/* sleep until the socket has something, without holding a ring */
+static int kring_wait(ksocket_t socket, int flags) {
+	char byte;
+	int ret;
+
+	if (flags & MSG_DONTWAIT)
+		return 0;
+
+	if (!ksocket_get(socket))
+		return -EBADF;
+	if (socket->local) {
+		ret = wait_event_interruptible(klocal_rx(socket)->wq,
+					       klocal_pipe_readable(klocal_rx(socket))) ? -EINTR : 0;
+		ksocket_put(socket);
+		return ret;
+	}
+	ksocket_put(socket);
+
+	ret = krecv(socket, &byte, 1, MSG_PEEK);
+	return ret < 0 ? ret : 0;
+}
+
+static ssize_t kring_recv(ksocket_t socket, size_t length, int flags, bool with_addr) {
+	struct sockaddr_storage addr;
+	struct kring_rec *rec;
+	struct kring *r;
+	u32 mask = kring_size - 1;
+	u32 cons, used, contig, avail, addr_space, need;
+	int addr_len = sizeof(addr);
+	bool dgram;
+	char byte;
+	ssize_t n;
+	int ret;
+
+	if (!kring_rings)
+		return -ENODEV;
+
+	ret = kring_wait(socket, flags);
+	if (ret < 0)
+		return ret;
+
+	if (!ksocket_get(socket))
+		return -EBADF;
+	dgram = !socket->local && socket->sock->type != SOCK_STREAM;
+	ksocket_put(socket);
+
+	addr_space = with_addr ? ALIGN(sizeof(addr), 8) : 0;
+	r = &kring_rings[raw_smp_processor_id()];
+	mutex_lock(&r->lock);
+
+	/*
+	 * A datagram is all or nothing: a short read would have the stack
+	 * drop its tail, so learn its size first and refuse it if the ring
+	 * cannot take it whole. Streams just read what fits.
+	 */
+	need = 8;
+	if (dgram) {
+		n = krecv(socket, &byte, 1, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+		if (n < 0) {
+			mutex_unlock(&r->lock);
+			return n;
+		}
+		length = min_t(size_t, length, n);
+		need = ALIGN(length, 8);
+		if (sizeof(*rec) + addr_space + need > kring_size)
+			goto full;
+	}
+	need += sizeof(*rec) + addr_space;
+
+	cons = smp_load_acquire(&r->hdr->consumer);
+	used = r->head - cons;
+	contig = kring_size - (r->head & mask);
+
+	/* records never wrap: pad out the tail when too little is left */
+	if (contig < need) {
+		if (kring_size - used < contig)
+			goto full;
+		rec = (struct kring_rec *)(r->data + (r->head & mask));
+		rec->len = contig - sizeof(*rec);
+		rec->addr_len = 0;
+		rec->type = KRING_REC_PAD;
+		r->head += contig;
+		used += contig;
+		contig = kring_size;
+	}
+
+	avail = min(kring_size - used, contig);
+	if (avail < need)
+		goto full;
+	length = min_t(size_t, length, avail - sizeof(*rec) - addr_space);
+
+	/* the one copy: straight from the socket into the mapped ring */
+	rec = (struct kring_rec *)(r->data + (r->head & mask));
+	if (with_addr)
+		n = krecvfrom(socket, (char *)(rec + 1) + addr_space, length,
+			      (flags & ~MSG_MORE) | MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_len);
+	else
+		n = krecv(socket, rec + 1, length, (flags & ~MSG_MORE) | MSG_DONTWAIT);
+
+	if (n > 0) {
+		rec->len = n;
+		rec->addr_len = with_addr ? min_t(int, addr_len, sizeof(addr)) : 0;
+		rec->type = KRING_REC_DATA;
+		if (rec->addr_len)
+			memcpy(rec + 1, &addr, rec->addr_len);
+		r->head += ALIGN(sizeof(*rec) + addr_space + n, 8);
+		KSOCKET_STAT_INC(ring_records);
+	}
+
+	/* MSG_MORE batches: publish on the last receive or kring_flush() */
+	if (!(flags & MSG_MORE))
+		kring_publish(r);
+	mutex_unlock(&r->lock);
+	return n;
+
+full:
+	KSOCKET_STAT_INC(ring_full);
+	kring_publish(r);
+	mutex_unlock(&r->lock);
+	return -ENOBUFS;
+}
+
+ssize_t krecv_ring(ksocket_t socket, size_t length, int flags) {
+	return kring_recv(socket, length, flags, false);
+}
+
+ssize_t krecvfrom_ring(ksocket_t socket, size_t length, int flags) {
+	return kring_recv(socket, length, flags, true);
+}
+
+static int kring_mmap(struct file *file, struct vm_area_struct *vma) {
+	if (vma->vm_flags & VM_EXEC)
+		return -EPERM;
+	return remap_vmalloc_range(vma, kring_area, vma->vm_pgoff);
+}
+
+static __poll_t kring_poll(struct file *file, poll_table *wait) {
+	unsigned int cpu;
+
+	poll_wait(file, &kring_wq, wait);
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		struct kring_header *hdr = kring_rings[cpu].hdr;
+
+		if (smp_load_acquire(&hdr->producer) != READ_ONCE(hdr->consumer))
+			return EPOLLIN | EPOLLRDNORM;
+	}
+	return 0;
+}
+
+static const struct file_operations kring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nonseekable_open,
+	.mmap		= kring_mmap,
+	.poll		= kring_poll,
+};
+
+static struct miscdevice kring_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "ksocket_ring",
+	.fops		= &kring_fops,
+	.mode		= 0600,
+};
+
+static int kring_init(void) {
+	size_t stride;
+	unsigned int cpu;
+	int ret;
+
+	if (!ring_pages)
+		return 0;
+
+	/* ring offsets are u32, keep well clear of wrapping the size */
+	if (ring_pages > KRING_MAX_BYTES / PAGE_SIZE) {
+		pr_err("%s: ring_pages %u over the %lu limit\n", KSOCKET_NAME,
+		       ring_pages, KRING_MAX_BYTES / PAGE_SIZE);
+		return -EINVAL;
+	}
+	ring_pages = roundup_pow_of_two(ring_pages);
+	kring_size = ring_pages * PAGE_SIZE;
+	stride = (1 + ring_pages) * PAGE_SIZE;
+
+	kring_area = vmalloc_user(array_size(stride, nr_cpu_ids));
+	kring_rings = kcalloc(nr_cpu_ids, sizeof(*kring_rings), GFP_KERNEL);
+	if (!kring_area || !kring_rings) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		struct kring *r = &kring_rings[cpu];
+
+		mutex_init(&r->lock);
+		r->hdr = (struct kring_header *)((char *)kring_area + cpu * stride);
+		r->data = (char *)r->hdr + PAGE_SIZE;
+		r->hdr->size = kring_size;
+		r->hdr->nr_rings = nr_cpu_ids;
+		r->hdr->stride = stride;
 	}
-	ret = sk->ops->getsockopt(sk, level, optname, (char *)optval, optlen);
 
+	ret = misc_register(&kring_dev);
+	if (ret < 0)
+		goto fail;
+	return 0;
+
+fail:
+	kfree(kring_rings);
+	kring_rings = NULL;
+	vfree(kring_area);
+	kring_area = NULL;
 	return ret;
 }
 
+static void kring_exit(void) {
+	if (!kring_rings)
+		return;
+
+	misc_deregister(&kring_dev);
+	kfree(kring_rings);
+	vfree(kring_area);
+}
+
 //helper functions
 unsigned int inet_addr(char* ip) {
-	int a, b, c, d;
-	char addr[4];
-	
-	sscanf(ip, "%d.%d.%d.%d", &a, &b, &c, &d);
-	addr[0] = a;
-	addr[1] = b;
-	addr[2] = c;
-	addr[3] = d;
-	
-	return *(unsigned int *)addr;
+	__be32 addr;
+
+	if (!in4_pton(ip, -1, (u8 *)&addr, '\0', NULL))
+		return INADDR_NONE;
+	return addr;
 }
 
 char *inet_ntoa(struct in_addr *in) {
 	char* str_ip = NULL;
-	u_int32_t int_ip = 0;
 	
-	str_ip = kmalloc(16 * sizeof(char), GFP_KERNEL);
+	str_ip = kmalloc(INET_ADDRSTRLEN, GFP_KERNEL);
 	if (!str_ip) {
 		return NULL;
 	}
-	else {
-		memset(str_ip, 0, 16);
-	}
-	int_ip = in->s_addr;
-	
-	sprintf(str_ip, "%d.%d.%d.%d",  (int_ip      ) & 0xFF,
-					(int_ip >> 8 ) & 0xFF,
-					(int_ip >> 16) & 0xFF,
-					(int_ip >> 24) & 0xFF);
+	kinet_ntop(AF_INET, in, str_ip, INET_ADDRSTRLEN);
 	return str_ip;
 }
 
+int kinet_pton(int family, const char *src, void *dst) {
+	if (family == AF_INET)
+		return in4_pton(src, -1, dst, '\0', NULL) ? 0 : -EINVAL;
+	if (family == AF_INET6)
+		return in6_pton(src, -1, dst, '\0', NULL) ? 0 : -EINVAL;
+	return -EAFNOSUPPORT;
+}
+
+int kinet_ntop(int family, const void *src, char *dst, size_t size) {
+	int n;
+
+	if (family == AF_INET)
+		n = snprintf(dst, size, "%pI4", src);
+	else if (family == AF_INET6)
+		n = snprintf(dst, size, "%pI6c", src);
+	else
+		return -EAFNOSUPPORT;
+
+	return (size_t)n < size ? n : -ENOSPC;
+}
+
+/* "a.b.c.d", "a.b.c.d:port", "v6addr", "[v6addr]:port", v6 may carry %scope */
+int ksockaddr_parse(const char *str, struct sockaddr_storage *addr, int *address_len) {
+	char host[KSOCKADDR_STRLEN];
+	const char *port = NULL, *end, *colon;
+	size_t len;
+	int ret;
+
+	if (*str == '[') {
+		end = strchr(++str, ']');
+		if (!end || (end[1] && end[1] != ':'))
+			return -EINVAL;
+		if (end[1])
+			port = end + 2;
+	} else {
+		colon = strchr(str, ':');
+		/* a single colon separates a v4 port, more make it v6 */
+		if (colon && !strchr(colon + 1, ':')) {
+			end = colon;
+			port = colon + 1;
+		} else {
+			end = str + strlen(str);
+		}
+	}
+
+	len = end - str;
+	if (!len || len >= sizeof(host))
+		return -EINVAL;
+	memcpy(host, str, len);
+	host[len] = '\0';
+
+	memset(addr, 0, sizeof(*addr));
+	ret = inet_pton_with_scope(&init_net, AF_UNSPEC, host, port, addr);
+	if (ret < 0)
+		return ret;
+
+	if (address_len)
+		*address_len = ksockaddr_len(addr->ss_family);
+	return 0;
+}
+
+int ksockaddr_format(const struct sockaddr *address, char *buf, size_t size) {
+	int n;
+
+	if (!ksockaddr_len(address->sa_family))
+		return -EAFNOSUPPORT;
+
+	/* a.b.c.d:port or [v6]:port */
+	n = snprintf(buf, size, "%pISpc", address);
+	return (size_t)n < size ? n : -ENOSPC;
+}
+
+unsigned int ksockaddr_hash(const struct sockaddr *address, unsigned int seed) {
+	const struct sockaddr_in6 *sin6;
+	const struct sockaddr_in *sin;
+
+	if (address->sa_family == AF_INET) {
+		sin = (const struct sockaddr_in *)address;
+		return jhash_2words((__force u32)sin->sin_addr.s_addr,
+				    (__force u32)sin->sin_port, seed);
+	}
+	if (address->sa_family == AF_INET6) {
+		sin6 = (const struct sockaddr_in6 *)address;
+		return jhash2((const u32 *)&sin6->sin6_addr, 4,
+			      seed ^ (__force u32)sin6->sin6_port);
+	}
+	return 0;
+}
+
+bool ksockaddr_equal(const struct sockaddr *a, const struct sockaddr *b) {
+	const struct sockaddr_in6 *a6, *b6;
+	const struct sockaddr_in *a4, *b4;
+
+	if (a->sa_family != b->sa_family)
+		return false;
+
+	if (a->sa_family == AF_INET) {
+		a4 = (const struct sockaddr_in *)a;
+		b4 = (const struct sockaddr_in *)b;
+		return a4->sin_addr.s_addr == b4->sin_addr.s_addr &&
+		       a4->sin_port == b4->sin_port;
+	}
+	if (a->sa_family == AF_INET6) {
+		a6 = (const struct sockaddr_in6 *)a;
+		b6 = (const struct sockaddr_in6 *)b;
+		return ipv6_addr_equal(&a6->sin6_addr, &b6->sin6_addr) &&
+		       a6->sin6_port == b6->sin6_port &&
+		       a6->sin6_scope_id == b6->sin6_scope_id;
+	}
+	return false;
+}
+
 //module init and cleanup procedure
 static int ksocket_init(void) {
+	int ret;
+
+	BUILD_BUG_ON(ARRAY_SIZE(ksocket_stat_names) * sizeof(u64) != sizeof(struct ksocket_stats));
+
 	printk("%s version %s\n%s\n%s\n", 
 		KSOCKET_NAME, KSOCKET_VERSION,
 		KSOCKET_DESCPT, KSOCKET_AUTHOR);
 
+	if (!proc_create_single(KSOCKET_NAME, 0444, init_net.proc_net, ksocket_stats_show))
+		return -ENOMEM;
+
+	ret = kring_init();
+	if (ret < 0) {
+		remove_proc_entry(KSOCKET_NAME, init_net.proc_net);
+		return ret;
+	}
+
 	return 0;
 }
 
 static void ksocket_exit(void) {
+	kring_exit();
+	remove_proc_entry(KSOCKET_NAME, init_net.proc_net);
 	printk("ksocket exit\n");
 }
 
@@ -361,3 +4073,71 @@ EXPORT_SYMBOL(ksetsockopt);
 EXPORT_SYMBOL(kgetsockopt);
 EXPORT_SYMBOL(inet_addr);
 EXPORT_SYMBOL(inet_ntoa);
+EXPORT_SYMBOL(khold);
+EXPORT_SYMBOL(kput);
+EXPORT_SYMBOL(klocal_listen);
+EXPORT_SYMBOL(klocal_connect);
+EXPORT_SYMBOL(krecv_ring);
+EXPORT_SYMBOL(krecvfrom_ring);
+EXPORT_SYMBOL(kring_flush);
+EXPORT_SYMBOL(kmcast_join);
+EXPORT_SYMBOL(kmcast_leave);
+EXPORT_SYMBOL(kmcast_set);
+EXPORT_SYMBOL(ksendto_fanout);
+EXPORT_SYMBOL(kget_tcp_info);
+EXPORT_SYMBOL(kset_congestion);
+EXPORT_SYMBOL(kget_congestion);
+EXPORT_SYMBOL(ktcp_sample_start);
+EXPORT_SYMBOL(ktcp_sample_last);
+EXPORT_SYMBOL(ktcp_sample_stop);
+EXPORT_SYMBOL(kget_sendq);
+EXPORT_SYMBOL(kset_send_watermarks);
+EXPORT_SYMBOL(kset_writable_cb);
+EXPORT_SYMBOL(kset_pacing_rate);
+EXPORT_SYMBOL(kbucket_create);
+EXPORT_SYMBOL(kbucket_destroy);
+EXPORT_SYMBOL(kbucket_set_rate);
+EXPORT_SYMBOL(kbucket_throttled_ns);
+EXPORT_SYMBOL(kset_rate_limit);
+EXPORT_SYMBOL(kinet_pton);
+EXPORT_SYMBOL(kinet_ntop);
+EXPORT_SYMBOL(ksockaddr_parse);
+EXPORT_SYMBOL(ksockaddr_format);
+EXPORT_SYMBOL(ksockaddr_hash);
+EXPORT_SYMBOL(ksockaddr_equal);
+EXPORT_SYMBOL(kreuse_create);
+EXPORT_SYMBOL(kreuse_destroy);
+EXPORT_SYMBOL(kreuse_grow);
+EXPORT_SYMBOL(kreuse_shrink);
+EXPORT_SYMBOL(kreuse_count);
+EXPORT_SYMBOL(kreuse_get);
+EXPORT_SYMBOL(kreuse_attach_cbpf);
+EXPORT_SYMBOL(kreuse_attach_ebpf);
+EXPORT_SYMBOL(kreuse_steer_cpu);
+EXPORT_SYMBOL(kreuse_detach);
+EXPORT_SYMBOL(krpc_create);
+EXPORT_SYMBOL(krpc_destroy);
+EXPORT_SYMBOL(krpc_call);
+EXPORT_SYMBOL(krpc_call_async);
+EXPORT_SYMBOL(krpc_serve);
+EXPORT_SYMBOL(ktls_start);
+EXPORT_SYMBOL(ktls_set_key);
+EXPORT_SYMBOL(ksend_tls_record);
+EXPORT_SYMBOL(krecv_tls);
+EXPORT_SYMBOL(kset_busy_poll);
+EXPORT_SYMBOL(kget_stats);
+EXPORT_SYMBOL(kget_incoming_cpu);
+EXPORT_SYMBOL(kget_numa_node);
+EXPORT_SYMBOL(kalloc_local);
+EXPORT_SYMBOL(kserver_start);
+EXPORT_SYMBOL(kserver_stop);
+EXPORT_SYMBOL(klisten_fastopen);
+EXPORT_SYMBOL(kconnect_send);
+EXPORT_SYMBOL(klisten_defer);
+EXPORT_SYMBOL(kaccept_data);
+EXPORT_SYMBOL(kidle_create);
+EXPORT_SYMBOL(kidle_destroy);
+EXPORT_SYMBOL(kidle_add);
+EXPORT_SYMBOL(kidle_del);
+EXPORT_SYMBOL(kidle_touch);
+EXPORT_SYMBOL(kset_keepalive);